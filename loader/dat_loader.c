@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "dat_loader.h"
+#include "sdm_lib.h"
+
+#define DAT_MAX_CHUNKS 256
+#define DAT_MIN_CHUNK_BYTES (1024*1024)
+#define DAT_MAX_VALUE_LENGTH 512
+
+typedef struct {
+  const char *begin;
+  const char *end;
+  int64_t first_row;
+  int64_t num_rows;
+  int64_t *times_ns;
+  double *values;
+} DatChunk;
+
+struct DatFile {
+  const char *data;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+  char *dataset_name;
+  bool is_vector;
+  int64_t num_rows;
+  DatChunk chunks[DAT_MAX_CHUNKS];
+  size_t num_chunks;
+};
+
+static const char *line_end(const char *line, const char *end) {
+  const char *nl = memchr(line, '\n', end - line);
+  return nl != NULL ? nl : end;
+}
+
+static size_t line_length(const char *line, const char *eol) {
+  size_t length = eol - line;
+  if (length > 0 && line[length - 1] == '\r') length--;
+  return length;
+}
+
+static int map_file(DatFile *dat, const char *file_path) {
+#ifdef _WIN32
+  dat->file = CreateFileA(file_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL, NULL);
+  if (dat->file == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "ERROR: Could not open %s\n", file_path);
+    return -1;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(dat->file, &size)) return -1;
+  dat->size = (size_t)size.QuadPart;
+  if (dat->size == 0) return 0;
+  dat->mapping = CreateFileMappingA(dat->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (dat->mapping == NULL) return -1;
+  dat->data = MapViewOfFile(dat->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (dat->data == NULL) return -1;
+#else
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", file_path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  dat->size = (size_t)st.st_size;
+  if (dat->size > 0) {
+    void *data = mmap(NULL, dat->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "ERROR: Could not map %s: %s\n", file_path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    dat->data = data;
+  }
+  close(fd);
+#endif
+  return 0;
+}
+
+static void unmap_file(DatFile *dat) {
+#ifdef _WIN32
+  if (dat->data != NULL) UnmapViewOfFile(dat->data);
+  if (dat->mapping != NULL) CloseHandle(dat->mapping);
+  if (dat->file != NULL && dat->file != INVALID_HANDLE_VALUE) CloseHandle(dat->file);
+#else
+  if (dat->data != NULL) munmap((void*)dat->data, dat->size);
+#endif
+  dat->data = NULL;
+}
+
+static void *count_chunk_rows(void *arg) {
+  DatChunk *chunk = arg;
+  chunk->num_rows = 0;
+  for (const char *line = chunk->begin; line < chunk->end;) {
+    const char *eol = line_end(line, chunk->end);
+    if (line_length(line, eol) > 0) chunk->num_rows++;
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+static int64_t days_from_civil(int64_t y, int m, int d) {
+  // Days since 1970-01-01 in the proleptic Gregorian calendar
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static bool parse_digits(const char *s, int count, int *out) {
+  int val = 0;
+  for (int i=0; i<count; i++) {
+    if (s[i] < '0' || s[i] > '9') return false;
+    val = val * 10 + (s[i] - '0');
+  }
+  *out = val;
+  return true;
+}
+
+static bool parse_line(const char *line, size_t length, int64_t *time_ns, double *value) {
+  // YYYY-MM-DD_HH:MM:SS.ffffff <value>
+  const size_t time_length = 26;
+  if (length <= time_length + 1) return false;
+  if (line[4] != '-' || line[7] != '-' || line[10] != '_' || line[13] != ':' ||
+      line[16] != ':' || line[19] != '.' || line[time_length] != ' ') return false;
+
+  int year, month, day, hour, minute, second, micros;
+  if (!parse_digits(line,      4, &year))   return false;
+  if (!parse_digits(line + 5,  2, &month))  return false;
+  if (!parse_digits(line + 8,  2, &day))    return false;
+  if (!parse_digits(line + 11, 2, &hour))   return false;
+  if (!parse_digits(line + 14, 2, &minute)) return false;
+  if (!parse_digits(line + 17, 2, &second)) return false;
+  if (!parse_digits(line + 20, 6, &micros)) return false;
+
+  int64_t seconds = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+  *time_ns = seconds * 1000000000 + (int64_t)micros * 1000;
+
+  // The mapping isn't NUL terminated, so strtod gets a copy
+  size_t value_length = length - time_length - 1;
+  if (value_length >= DAT_MAX_VALUE_LENGTH) return false;
+  char value_str[DAT_MAX_VALUE_LENGTH];
+  memcpy(value_str, line + time_length + 1, value_length);
+  value_str[value_length] = '\0';
+  char *end_ptr;
+  *value = strtod(value_str, &end_ptr);
+  if (end_ptr == value_str) *value = NAN;
+  return true;
+}
+
+static void *parse_chunk(void *arg) {
+  DatChunk *chunk = arg;
+  int64_t row = 0;
+  for (const char *line = chunk->begin; line < chunk->end && row < chunk->num_rows;) {
+    const char *eol = line_end(line, chunk->end);
+    size_t length = line_length(line, eol);
+    if (length > 0) {
+      int64_t *time_ns = &chunk->times_ns[chunk->first_row + row];
+      double *value = &chunk->values[chunk->first_row + row];
+      if (!parse_line(line, length, time_ns, value)) {
+        *time_ns = DAT_BAD_TIME;
+        *value = NAN;
+      }
+      row++;
+    }
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+DatFile *dat_open(const char *file_path) {
+  DatFile *dat = calloc(1, sizeof(DatFile));
+  if (dat == NULL) return NULL;
+  if (map_file(dat, file_path) != 0) {
+    dat_close(dat);
+    return NULL;
+  }
+
+  // Skip the quoted header lines, picking the dataset name out of them on the way
+  const char *begin = dat->data;
+  const char *end = dat->data != NULL ? dat->data + dat->size : NULL;
+  const char *dataset_tag = "\"# DATASET= ";
+  while (begin < end && *begin == '"') {
+    const char *eol = line_end(begin, end);
+    size_t length = line_length(begin, eol);
+    if (dat->dataset_name == NULL && length > strlen(dataset_tag) &&
+        strncmp(begin, dataset_tag, strlen(dataset_tag)) == 0) {
+      size_t name_length = length - strlen(dataset_tag);
+      if (begin[length - 1] == '"') name_length--;
+      dat->dataset_name = malloc(name_length + 1);
+      if (dat->dataset_name != NULL) {
+        memcpy(dat->dataset_name, begin + strlen(dataset_tag), name_length);
+        dat->dataset_name[name_length] = '\0';
+      }
+    }
+    begin = eol + 1;
+  }
+  if (begin > end) begin = end;
+  dat->is_vector = begin < end && memchr(begin, '[', line_end(begin, end) - begin) != NULL;
+
+  // Split the rows into one chunk per CPU, each ending on a line boundary
+  size_t num_chunks = SDM_cpu_count();
+  size_t max_chunks = (size_t)(end - begin) / DAT_MIN_CHUNK_BYTES + 1;
+  if (num_chunks > max_chunks) num_chunks = max_chunks;
+  if (num_chunks > DAT_MAX_CHUNKS) num_chunks = DAT_MAX_CHUNKS;
+  const char *chunk_begin = begin;
+  for (size_t i=0; i<num_chunks; i++) {
+    const char *chunk_end = end;
+    if (i + 1 < num_chunks) {
+      chunk_end = begin + (size_t)(end - begin) * (i + 1) / num_chunks;
+      if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+      chunk_end = line_end(chunk_end, end);
+      if (chunk_end < end) chunk_end++;
+    }
+    dat->chunks[i] = (DatChunk){.begin=chunk_begin, .end=chunk_end};
+    chunk_begin = chunk_end;
+  }
+  dat->num_chunks = num_chunks;
+
+  if (SDM_run_threads(count_chunk_rows, dat->chunks, sizeof(DatChunk), dat->num_chunks) != 0) {
+    dat_close(dat);
+    return NULL;
+  }
+  for (size_t i=0; i<dat->num_chunks; i++) {
+    dat->chunks[i].first_row = dat->num_rows;
+    dat->num_rows += dat->chunks[i].num_rows;
+  }
+
+  return dat;
+}
+
+const char *dat_dataset_name(const DatFile *dat) {
+  return dat->dataset_name != NULL ? dat->dataset_name : "";
+}
+
+int64_t dat_num_rows(const DatFile *dat) {
+  return dat->num_rows;
+}
+
+int dat_parse(DatFile *dat, int64_t *times_ns, double *values) {
+  // times_ns and values must both have room for dat_num_rows() items
+  if (dat->is_vector) {
+    fprintf(stderr, "ERROR: Only scalar datasets can be loaded (%s)\n", dat_dataset_name(dat));
+    return -1;
+  }
+  for (size_t i=0; i<dat->num_chunks; i++) {
+    dat->chunks[i].times_ns = times_ns;
+    dat->chunks[i].values = values;
+  }
+  return SDM_run_threads(parse_chunk, dat->chunks, sizeof(DatChunk), dat->num_chunks);
+}
+
+void dat_close(DatFile *dat) {
+  if (dat == NULL) return;
+  unmap_file(dat);
+  if (dat->dataset_name) FREE(dat->dataset_name);
+  free(dat);
+}
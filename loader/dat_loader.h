@@ -0,0 +1,32 @@
+#ifndef _DAT_LOADER_H
+#define _DAT_LOADER_H
+
+#include <stdint.h>
+
+// Fast loader for the archiver's scalar .dat output, built as a shared library so that it can be
+// called from Python (see plot_archived_data.py).  The file is memory mapped and its lines are
+// parsed in parallel chunks.  Timestamps come out as nanoseconds since 1970-01-01 of the local
+// time written in the file (i.e. the same as numpy's datetime64[ns] of the naive time string).
+
+#ifdef _WIN32
+#  ifdef ARCHIVER_DAT_BUILD
+#    define DAT_API __declspec(dllexport)
+#  else
+#    define DAT_API __declspec(dllimport)
+#  endif
+#else
+#  define DAT_API
+#endif
+
+// Marks a line that could not be parsed.  Same value as numpy's NaT.
+#define DAT_BAD_TIME INT64_MIN
+
+typedef struct DatFile DatFile;
+
+DAT_API DatFile *dat_open(const char *file_path);
+DAT_API const char *dat_dataset_name(const DatFile *dat);
+DAT_API int64_t dat_num_rows(const DatFile *dat);
+DAT_API int dat_parse(DatFile *dat, int64_t *times_ns, double *values);
+DAT_API void dat_close(DatFile *dat);
+
+#endif // !_DAT_LOADER_H
@@ -1,20 +1,66 @@
 from concurrent.futures import ProcessPoolExecutor
 from datetime import datetime as dt
 from matplotlib import pyplot as plt
+import ctypes
 import numpy as np
+import os
 import sys
 import time
 import warnings
 import numpy.typing as npt
-from typing import Tuple, List
+from typing import Optional, Tuple, List
 
 narray_f64 = npt.NDArray[np.float64]
 narray_dt = npt.NDArray[np.datetime64]
 
+TANGO_PREFIX = "tango://g-v-csdb-0.maxiv.lu.se:10000/"
+
+def load_native_loader() -> Optional[ctypes.CDLL]:
+    # The archiver_dat library is built alongside the archiver.  Point ARCHIVER_DAT_LIB at it, or
+    # leave it in (or in a build/ or bin/ folder next to) this script.
+    names = ["libarchiver_dat.so", "libarchiver_dat.dylib", "archiver_dat.dll"]
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [os.environ.get("ARCHIVER_DAT_LIB", "")]
+    for folder in [here, os.path.join(here, "build"), os.path.join(here, "bin")]:
+        candidates += [os.path.join(folder, name) for name in names]
+
+    for path in candidates:
+        if not path or not os.path.exists(path):
+            continue
+        lib = ctypes.CDLL(path)
+        lib.dat_open.restype = ctypes.c_void_p
+        lib.dat_open.argtypes = [ctypes.c_char_p]
+        lib.dat_dataset_name.restype = ctypes.c_char_p
+        lib.dat_dataset_name.argtypes = [ctypes.c_void_p]
+        lib.dat_num_rows.restype = ctypes.c_int64
+        lib.dat_num_rows.argtypes = [ctypes.c_void_p]
+        lib.dat_parse.restype = ctypes.c_int
+        lib.dat_parse.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+        lib.dat_close.restype = None
+        lib.dat_close.argtypes = [ctypes.c_void_p]
+        return lib
+    return None
+
+def parse_file_native(lib: ctypes.CDLL, filename: str) -> Tuple[str, narray_f64, narray_dt]:
+    handle = lib.dat_open(os.fsencode(filename))
+    if not handle:
+        raise Exception(f"Could not open {filename}")
+    try:
+        line_title: str = lib.dat_dataset_name(handle).decode().split(TANGO_PREFIX)[-1]
+        num_rows: int = lib.dat_num_rows(handle)
+        times_ns: npt.NDArray[np.int64] = np.empty(num_rows, dtype=np.int64)
+        values: narray_f64 = np.empty(num_rows, dtype=np.float64)
+        if lib.dat_parse(handle, times_ns.ctypes.data, values.ctypes.data) != 0:
+            raise Exception(f"Could not parse {filename}")
+    finally:
+        lib.dat_close(handle)
+
+    return line_title, values, times_ns.view("datetime64[ns]")
+
 def parse_file(filename: str) -> Tuple[str, narray_f64, narray_dt]:
     with open(filename) as f:
         header: str = f.readline()
-        line_title: str = header.split("tango://g-v-csdb-0.maxiv.lu.se:10000/")[1][:-2]
+        line_title: str = header.split(TANGO_PREFIX)[1][:-2]
         next(f)
     
         data: npt.NDArray[np.str_] = np.loadtxt(f, delimiter=" ", dtype=str, ndmin=2)
@@ -34,8 +80,13 @@ if __name__ == "__main__":
     start: float = time.time()
 
     filenames: List[str] = sys.argv[1:]
-    with ProcessPoolExecutor() as executor:
-        results = list(executor.map(parse_file, filenames))
+    native_loader = load_native_loader()
+    if native_loader is not None:
+        # The native loader already parses each file on all cores
+        results = [parse_file_native(native_loader, filename) for filename in filenames]
+    else:
+        with ProcessPoolExecutor() as executor:
+            results = list(executor.map(parse_file, filenames))
     processing_time: float = time.time() - start
     print(f"Time to process {len(results)} datasets = {processing_time:0.3f} seconds")
 
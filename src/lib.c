@@ -1,18 +1,138 @@
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #define _XOPEN_SOURCE 700
 #define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
 #include "lib.h"
 #include "sdm_lib.h"
 
 #define MAX_QUERYSTR_LENGTH 256
 
+const char *profile_phase_names[PHASE_COUNT] = {
+  [PHASE_CONNECT]         = "connect",
+  [PHASE_RESOLVE]         = "resolve",
+  [PHASE_ESTIMATE]        = "estimate",
+  [PHASE_SERVER]          = "server",
+  [PHASE_TRANSFER]        = "transfer",
+  [PHASE_TIME_CONVERSION] = "time_conversion",
+  [PHASE_VALUE_PARSING]   = "value_parsing",
+  [PHASE_DECIMATION]      = "decimation",
+  [PHASE_WRITING]         = "writing",
+};
+
+void profile_add(Profile *total, const Profile *p) {
+  for (size_t i=0; i<PHASE_COUNT; i++) total->phase_ns[i] += p->phase_ns[i];
+  total->rows_received += p->rows_received;
+  total->rows_kept += p->rows_kept;
+  total->bytes_received += p->bytes_received;
+  total->bytes_written += p->bytes_written;
+  total->arena_regions += p->arena_regions;
+}
+
+static char *sv_to_cstr(SDM_StringView sv) {
+  char *cstr = malloc(sv.length + 1);
+  if (cstr == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    exit(1);
+  }
+  memcpy(cstr, sv.data, sv.length);
+  cstr[sv.length] = '\0';
+  return cstr;
+}
+
+int read_db_config(const char *file_path, DbEndpoints *endpoints) {
+  // Each non-empty line that doesn't start with '#' is "<name> <connection string>", e.g.
+  //   machine   postgresql://hdb_viewer@timescaledb.maxiv.lu.se:15432/hdb_machine
+  //   beamline  host=localhost port=5433 dbname=hdb_beamline user=hdb_viewer
+  int result = 0;
+  char *contents = SDM_read_entire_file(file_path);
+  SDM_StringView sv = SDM_cstr_as_sv(contents);
+  size_t line_num = 0;
+
+  while (sv.length > 0) {
+    SDM_StringView line = SDM_sv_pop_by_delim(&sv, '\n');
+    line_num++;
+    SDM_sv_trim(&line);
+    while (line.length > 0 && isspace((unsigned char)line.data[line.length - 1])) line.length--;
+    if (line.length == 0 || line.data[0] == '#') continue;
+
+    SDM_StringView name = {.data=line.data};
+    while (name.length < line.length && !isspace((unsigned char)name.data[name.length])) name.length++;
+    SDM_StringView conninfo = SDM_sized_str_as_sv(line.data + name.length, line.length - name.length);
+    SDM_sv_trim(&conninfo);
+    if (conninfo.length == 0) {
+      fprintf(stderr, "ERROR: %s:%zu: No connection string given for \"" SDM_SV_F "\"\n",
+              file_path, line_num, SDM_SV_Vals(name));
+      defered_return(-1);
+    }
+
+    DbEndpoint endpoint = {.name=sv_to_cstr(name), .conninfo=sv_to_cstr(conninfo)};
+    SDM_ARRAY_PUSH((*endpoints), endpoint);
+  }
+
+  if (endpoints->length == 0) {
+    fprintf(stderr, "ERROR: No databases listed in %s\n", file_path);
+    defered_return(-1);
+  }
+
+defer:
+  FREE(contents);
+  return result;
+}
+
+void free_db_endpoints(DbEndpoints *endpoints) {
+  for (size_t i=0; i<endpoints->length; i++) {
+    FREE(endpoints->data[i].name);
+    FREE(endpoints->data[i].conninfo);
+  }
+  SDM_ARRAY_FREE((*endpoints));
+}
+
+static bool libpq_has_option(const char *keyword) {
+  PQconninfoOption *options = PQconndefaults();
+  bool found = false;
+  for (PQconninfoOption *opt=options; opt != NULL && opt->keyword != NULL; opt++) {
+    if (strcmp(opt->keyword, keyword) == 0) found = true;
+  }
+  PQconninfoFree(options);
+  return found;
+}
+
+PGconn *connect_to_endpoint(const DbEndpoint *endpoint, const char *password) {
+  // Everything before dbname is a default, which the connection string can override.  A dropped
+  // network usually leaves the socket silently dead, so keepalives (and, where libpq has it, a
+  // timeout on unacknowledged sends) make a blocked query fail within a minute or so instead of
+  // after the OS's two hours, and reconnect_with_backoff can then take over.
+  const char *keywords[16];
+  const char *values[16];
+  size_t n = 0;
+  keywords[n] = "password";            values[n++] = password;
+  keywords[n] = "connect_timeout";     values[n++] = "10";
+  keywords[n] = "keepalives";          values[n++] = "1";
+  keywords[n] = "keepalives_idle";     values[n++] = "30";
+  keywords[n] = "keepalives_interval"; values[n++] = "10";
+  keywords[n] = "keepalives_count";    values[n++] = "3";
+  if (libpq_has_option("tcp_user_timeout")) {
+    keywords[n] = "tcp_user_timeout";  values[n++] = "60000";
+  }
+  keywords[n] = "dbname";              values[n++] = endpoint->conninfo;
+  keywords[n] = NULL;                  values[n] = NULL;
+  return PQconnectdbParams(keywords, values, 1);
+}
+
 int get_ids_and_tables(PGconn *conn, const char *search_string, ArchiverAttrs *attrs) {
   char query_str[MAX_QUERYSTR_LENGTH];
   memset(query_str, 0, MAX_QUERYSTR_LENGTH);
@@ -47,56 +167,303 @@ int get_ids_and_tables(PGconn *conn, const char *search_string, ArchiverAttrs *a
   return num_hits;
 }
 
-static bool attr_is_scalar(ArchiverAttr attr) {
+bool attr_is_scalar(ArchiverAttr attr) {
   char *check_str = "att_scalar";
   return strncmp(attr.table, check_str, strlen(check_str)) == 0;
 }
 
+static void format_query_time(char *buf, size_t buf_size, struct tm t) {
+  // Use Central European Time for database query
+  // mktime() already normalized the time structures with proper DST handling,
+  // so we can use them directly with CET/CEST timezone
+  const char* timezone_str = t.tm_isdst > 0 ? "CEST" : "CET";
+  snprintf(buf, buf_size, "%02d-%02d-%02d %02d:%02d:%02d %s",
+           t.tm_year+1900,
+           t.tm_mon+1,
+           t.tm_mday,
+           t.tm_hour,
+           t.tm_min,
+           t.tm_sec,
+           timezone_str);
+}
+
+int estimate_attr_rows(PGconn *conn, ArchiverAttr attr, struct tm start, struct tm stop,
+                       AttrEstimate *estimate) {
+  // Asks the planner rather than counting, so this is cheap even for huge ranges.  The top plan
+  // line looks like "... (cost=0.43..1234.56 rows=123456 width=20)", where width is the average
+  // size in bytes of the selected columns from the table statistics.
+  char query_str[1024];
+  char start_str[256];
+  char stop_str[256];
+  format_query_time(start_str, sizeof(start_str), start);
+  format_query_time(stop_str, sizeof(stop_str), stop);
+  snprintf(query_str, sizeof(query_str),
+           "EXPLAIN SELECT att_conf_id, data_time, value_r FROM %s WHERE att_conf_id = %s AND "
+           "data_time BETWEEN '%s' AND '%s'",
+           attr.table, attr.id, start_str, stop_str);
+
+  PGresult *res = PQexec(conn, query_str);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1) {
+    fprintf(stderr, "%s", PQerrorMessage(conn));
+    PQclear(res);
+    return -1;
+  }
+
+  const char *plan = PQgetvalue(res, 0, 0);
+  const char *rows_str = strstr(plan, "rows=");
+  const char *width_str = strstr(plan, "width=");
+  if (rows_str == NULL || width_str == NULL) {
+    fprintf(stderr, "Could not understand the query plan: %s\n", plan);
+    PQclear(res);
+    return -1;
+  }
+  estimate->rows = strtoull(rows_str + strlen("rows="), NULL, 10);
+  size_t width = strtoull(width_str + strlen("width="), NULL, 10);
+
+  // The text PGresult is still held while it is parsed into the dataset.  Per row it has a tuple
+  // pointer (with room to grow), a value pointer and length per column and the terminated text,
+  // which for timestamps and numbers comes to about 2.5 times the binary width.
+  size_t result_row_bytes = 2*sizeof(char *) + 3*(sizeof(char *) + sizeof(int) + 1) + width*5/2;
+  if (attr_is_scalar(attr)) {
+    estimate->bytes = estimate->rows * (sizeof(AccurateTime) + sizeof(double) + result_row_bytes);
+  } else {
+    // The dataset's own copy of the array is about the binary width of the value
+    estimate->bytes = estimate->rows * (sizeof(AccurateTime) + sizeof(DynScalarArray) + width + result_row_bytes);
+  }
+
+  PQclear(res);
+  return 0;
+}
+
+int parse_element_ranges(const char *spec, ElementRanges *ranges) {
+  // Parses a comma separated list of "<index>" or "<start>:<stop>" items, e.g. "0:16,42"
+  if (spec == NULL) {
+    fprintf(stderr, "ERROR: No element selection given\n");
+    return -1;
+  }
+  size_t spec_len = strlen(spec);
+  char *spec_copy = malloc(spec_len + 1);
+  if (spec_copy == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    return -1;
+  }
+  memcpy(spec_copy, spec, spec_len + 1);
+
+  int result = 0;
+  size_t num_selected = 0;
+  // Empty items, including a trailing comma, are mistakes rather than something to skip
+  if (spec_len == 0 || spec[spec_len - 1] == ',') defered_return(-1);
+  SDM_StringView sv = SDM_sized_str_as_sv(spec_copy, spec_len);
+  while (sv.length > 0) {
+    SDM_StringView item = SDM_sv_pop_by_delim(&sv, ',');
+    item.data[item.length] = '\0';
+
+    // strtoul would skip spaces and accept a sign, wrapping "-1" round to a huge index
+    char *end_ptr;
+    ElementRange range = {0};
+    if (!isdigit((unsigned char)item.data[0])) defered_return(-1);
+    range.start = strtoul(item.data, &end_ptr, 10);
+    if (*end_ptr == ':') {
+      char *stop_str = end_ptr + 1;
+      if (!isdigit((unsigned char)*stop_str)) defered_return(-1);
+      range.stop = strtoul(stop_str, &end_ptr, 10);
+    } else {
+      range.stop = range.start + 1;
+    }
+    if (*end_ptr != '\0' || range.stop <= range.start) defered_return(-1);
+    if (range.stop > MAX_SELECTED_ELEMENTS || range.stop - range.start > MAX_SELECTED_ELEMENTS - num_selected) {
+      fprintf(stderr, "ERROR: At most %d elements, with indices below %d, can be selected\n",
+              MAX_SELECTED_ELEMENTS, MAX_SELECTED_ELEMENTS);
+      defered_return(-1);
+    }
+    num_selected += range.stop - range.start;
+
+    SDM_ARRAY_PUSH((*ranges), range);
+  }
+
+defer:
+  if (result != 0) fprintf(stderr, "ERROR: Could not parse element selection \"%s\"\n", spec);
+  FREE(spec_copy);
+  return result;
+}
+
+static int build_value_expr(char *buf, size_t buf_size, const ElementRanges *ranges) {
+  // Turns the element selection into arrays built element by element (PostgreSQL arrays are
+  // one-based).  Unlike a slice, subscripting past the end of a short array gives NULL rather than
+  // nothing, so every row has one value per selected index, in the same columns, and the missing
+  // ones come out as nan.
+  if (ranges->length == 0) return snprintf(buf, buf_size, "value_r") < (int)buf_size ? 0 : -1;
+
+  size_t used = 0;
+  for (size_t i=0; i<ranges->length; i++) {
+    int n = snprintf(buf + used, buf_size - used,
+                     "%sARRAY(SELECT value_r[i] FROM generate_series(%zu, %zu) AS i ORDER BY i)",
+                     i == 0 ? "" : " || ", ranges->data[i].start + 1, ranges->data[i].stop);
+    if (n < 0 || (size_t)n >= buf_size - used) return -1;
+    used += n;
+  }
+  return 0;
+}
+
+static void wait_for_reply(PGconn *conn) {
+  // Blocks until the server has started replying, or the socket has failed
+#ifdef _WIN32
+  WSAPOLLFD pfd = {.fd = (SOCKET)PQsocket(conn), .events = POLLRDNORM};
+  WSAPoll(&pfd, 1, -1);
+#else
+  struct pollfd pfd = {.fd = PQsocket(conn), .events = POLLIN};
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {}
+#endif
+}
+
+static PGresult *exec_profiled(PGconn *conn, const char *query_str, Profile *profile) {
+  // Same as PQexec, but when profiling splits the time spent into PHASE_SERVER and PHASE_TRANSFER
+  if (profile == NULL) return PQexec(conn, query_str);
+
+  uint64_t sent = SDM_now_ns();
+  if (!PQsendQuery(conn, query_str)) return NULL;
+  if (PQsocket(conn) >= 0) wait_for_reply(conn);
+  uint64_t first_reply = SDM_now_ns();
+
+  // Like PQexec, keep the last result
+  PGresult *res = NULL;
+  for (PGresult *next; (next = PQgetResult(conn)) != NULL;) {
+    PQclear(res);
+    res = next;
+  }
+  uint64_t done = SDM_now_ns();
+  profile->phase_ns[PHASE_SERVER] += first_reply - sent;
+  profile->phase_ns[PHASE_TRANSFER] += done - first_reply;
+  return res;
+}
+
+static void parse_db_value(const char *db_val_str, ArchiverAttr attr, DataType type, SDM_Arena *arena,
+                           double *scalar_val, DynScalarArray *elems) {
+  if (type == DATATYPE_SCALAR) {
+    if (strcmp(attr.table, "att_scalar_devboolean")==0) {
+      if (strcmp(db_val_str, "t")==0) {
+        *scalar_val = 1.0;
+      } else if (strcmp(db_val_str, "f")==0) {
+        *scalar_val = 0.0;
+      } else {
+        assert(0 && "unreachable code was reached");
+      }
+    } else {
+      char *end_ptr;
+      *scalar_val = strtod(db_val_str, &end_ptr);
+      if (db_val_str == end_ptr)
+          *scalar_val = NAN;
+    }
+  } else if (type == DATATYPE_VECTOR) {
+    if (*db_val_str == '{') db_val_str++;
+    size_t num_elems = 0;
+    if (*db_val_str != '}') {
+      num_elems = 1;
+      for (const char *c = db_val_str; *c != '\0' && *c != '}'; c++) {
+        if (*c == ',') num_elems++;
+      }
+    }
+
+    SDM_ARENA_ARRAY_INIT(arena, (*elems), num_elems);
+    while (*db_val_str != '}' && *db_val_str != '\0') {
+      char *end_ptr;
+      double val = strtod(db_val_str, &end_ptr);
+      if (db_val_str == end_ptr) {
+        // Not a number (e.g. NULL), so skip to the next element
+        val = NAN;
+        while (*end_ptr != ',' && *end_ptr != '}' && *end_ptr != '\0') end_ptr++;
+      }
+      db_val_str = end_ptr;
+      if (elems->length < elems->capacity) SDM_ARENA_PUSH((*elems), val);
+      while (*db_val_str == ',') {
+        db_val_str++;
+      }
+    }
+  }
+}
+
+static bool scalar_changed(double last, double val, const QueryOptions *opts) {
+  if (isnan(last) || isnan(val)) return isnan(last) != isnan(val);
+  double threshold = opts->deadband_relative ? opts->deadband * fabs(last) : opts->deadband;
+  return fabs(val - last) > threshold;
+}
+
+static bool vector_changed(DynScalarArray last, DynScalarArray val, const QueryOptions *opts) {
+  if (last.length != val.length) return true;
+  for (size_t i=0; i<val.length; i++) {
+    if (scalar_changed(last.data[i], val.data[i], opts)) return true;
+  }
+  return false;
+}
+
 int get_single_attr_data(
                   PGconn *conn, 
                   ArchiverAttr attr,
                   DataSet *dataset,
-                  struct tm start, struct tm stop) {
-  printf("INFO: Getting data for %s\n", attr.name);
-  char query_str[2048];
+                  struct tm start, struct tm stop,
+                  const QueryOptions *opts,
+                  FetchCursor *cursor,
+                  SDM_Arena *arena,
+                  Profile *profile) {
+  // Progress goes to stderr, as other workers may be writing data to stdout at the same time
+  fprintf(stderr, "INFO: Getting data for %s\n", attr.name);
+  char query_str[8192];
   char start_str[256];
   char stop_str[256];
   memset(query_str, 0, sizeof(query_str)/sizeof(char));
   memset(start_str, 0, sizeof(start_str)/sizeof(char));
   memset(stop_str, 0, sizeof(stop_str)/sizeof(char));
 
-  // Use Central European Time for database query
-  // mktime() already normalized the time structures with proper DST handling,
-  // so we can use them directly with CET/CEST timezone
-  
-  const char* timezone_str = start.tm_isdst > 0 ? "CEST" : "CET";
-  sprintf(start_str, "%02d-%02d-%02d %02d:%02d:%02d %s",
-           start.tm_year+1900,
-           start.tm_mon+1,
-           start.tm_mday,
-           start.tm_hour,
-           start.tm_min,
-           start.tm_sec,
-           timezone_str);
-  printf("INFO: Starting timestamp: %s\n", start_str);
-
-  timezone_str = stop.tm_isdst > 0 ? "CEST" : "CET";
-  sprintf(stop_str, "%02d-%02d-%02d %02d:%02d:%02d %s",
-           stop.tm_year+1900,
-           stop.tm_mon+1,
-           stop.tm_mday,
-           stop.tm_hour,
-           stop.tm_min,
-           stop.tm_sec,
-           timezone_str);
-  printf("INFO: Ending timestamp: %s\n", stop_str);
+  format_query_time(start_str, sizeof(start_str), start);
+  fprintf(stderr, "INFO: Starting timestamp: %s\n", start_str);
+  format_query_time(stop_str, sizeof(stop_str), stop);
+  fprintf(stderr, "INFO: Ending timestamp: %s\n", stop_str);
 
-  sprintf(query_str,
-          "SELECT * FROM %s WHERE att_conf_id = %s AND "
-          "data_time BETWEEN '%s' AND '%s' " "ORDER BY data_time",
-          attr.table, attr.id, start_str, stop_str);
-  printf("INFO: DB query string:\n\t%s\n", query_str);
-  PGresult *res = PQexec(conn, query_str);
+  // Element selection only applies to array attributes
+  ElementRanges no_ranges = {0};
+  const ElementRanges *ranges = attr_is_scalar(attr) ? &no_ranges : &opts->elements;
+  char value_expr[2048];
+  if (build_value_expr(value_expr, sizeof(value_expr), ranges) != 0) {
+    fprintf(stderr, "ERROR: Element selection is too long\n");
+    return -1;
+  }
+
+  // A cursor that has already got somewhere carries on from the row after its last_time.  That is
+  // exact as data_time is unique for each attribute.  The change filter also needs that last row
+  // itself, to compare the first new row against, but doesn't send it again.
+  bool resuming = cursor != NULL && cursor->last_time[0] != '\0';
+  char range_str[1024];
+  char limit_str[64] = "";
+  if (!resuming) {
+    snprintf(range_str, sizeof(range_str), "data_time BETWEEN '%s' AND '%s'", start_str, stop_str);
+  } else {
+    snprintf(range_str, sizeof(range_str), "data_time %s '%s' AND data_time <= '%s'",
+             opts->changes_only ? ">=" : ">", cursor->last_time, stop_str);
+  }
+  if (cursor != NULL && cursor->batch_rows > 0) {
+    snprintf(limit_str, sizeof(limit_str), " LIMIT %zu", cursor->batch_rows);
+  }
+
+  if (opts->changes_only) {
+    // Only send rows whose value differs from the row before, plus the first row of the range
+    snprintf(query_str, sizeof(query_str),
+            "SELECT att_conf_id, data_time, value_r FROM ("
+            "SELECT att_conf_id, data_time, value_r, "
+            "lag(value_r) OVER (ORDER BY data_time) AS prev_value_r, "
+            "row_number() OVER (ORDER BY data_time) AS row_num FROM ("
+            "SELECT att_conf_id, data_time, %s AS value_r "
+            "FROM %s WHERE att_conf_id = %s AND %s) AS selected) AS changes "
+            "WHERE %s value_r IS DISTINCT FROM prev_value_r ORDER BY data_time%s",
+            value_expr, attr.table, attr.id, range_str,
+            resuming ? "row_num > 1 AND" : "row_num = 1 OR", limit_str);
+  } else {
+    snprintf(query_str, sizeof(query_str),
+            "SELECT att_conf_id, data_time, %s FROM %s WHERE att_conf_id = %s AND "
+            "%s " "ORDER BY data_time%s",
+            value_expr, attr.table, attr.id, range_str, limit_str);
+  }
+  fprintf(stderr, "INFO: DB query string:\n\t%s\n", query_str);
+  PGresult *res = exec_profiled(conn, query_str, profile);
   if (PQresultStatus(res) != PGRES_TUPLES_OK) {
     fprintf(stderr, "%s", PQerrorMessage(conn));
     PQclear(res);
@@ -109,19 +476,78 @@ int get_single_attr_data(
             num_data_pts, MAX_ARRAY_LENGTH);
     fprintf(stderr, "To change this limit, edit the MAX_ARRAY_LENGTH value in the ");
     fprintf(stderr, "source file and recompile.\n");
-    exit(1);
+    PQclear(res);
+    return -1;
   }
 
+  // All of the arrays are taken from the arena at their final size, so the pushes below never
+  // need to grow them.  The top-level arrays are reserved in one go to keep them in one region.
   if (attr_is_scalar(attr)) {
     dataset->type = DATATYPE_SCALAR;
-    SDM_ENSURE_ARRAY_MIN_CAP((dataset->as.scalar_array), num_data_pts);
+    SDM_arena_reserve(arena, num_data_pts * (sizeof(AccurateTime) + sizeof(double))
+                             + 2 * sizeof(uintptr_t));
+    SDM_ARENA_ARRAY_INIT(arena, dataset->as.scalar_array, num_data_pts);
   } else {
     dataset->type = DATATYPE_VECTOR;
-    SDM_ENSURE_ARRAY_MIN_CAP((dataset->as.vector_array), num_data_pts);
+    SDM_arena_reserve(arena, num_data_pts * (sizeof(AccurateTime) + sizeof(DynScalarArray))
+                             + 2 * sizeof(uintptr_t));
+    SDM_ARENA_ARRAY_INIT(arena, dataset->as.vector_array, num_data_pts);
+  }
+  SDM_ARENA_ARRAY_INIT(arena, dataset->time_array, num_data_pts);
+
+  size_t num_indices = 0;
+  for (size_t i=0; i<ranges->length; i++) num_indices += ranges->data[i].stop - ranges->data[i].start;
+  SDM_ARENA_ARRAY_INIT(arena, dataset->element_indices, num_indices);
+  for (size_t i=0; i<ranges->length; i++) {
+    for (size_t index=ranges->data[i].start; index<ranges->data[i].stop; index++) {
+      SDM_ARENA_PUSH(dataset->element_indices, index);
+    }
   }
-  SDM_ENSURE_ARRAY_MIN_CAP((dataset->time_array), num_data_pts);
+
+  // The server has already dropped exact repeats, so the client side only needs to apply the
+  // deadband, against the last value kept rather than the previous row, so that slow drifts
+  // still show up
+  bool filter_changes = opts->changes_only && opts->deadband > 0.0;
+
+  // Carrying on from a cursor, the first row is compared against the last one kept before it
+  bool have_seed = filter_changes && cursor != NULL && cursor->last_value != NULL;
+  double seed_scalar = NAN;
+  DynScalarArray seed_elems = {0};
+  if (have_seed) parse_db_value(cursor->last_value, attr, dataset->type, arena, &seed_scalar, &seed_elems);
+  long last_kept_row = -1;
+
+  // The per-row timers are only read when profiling, as they cost about as much as a short row
+  uint64_t phase_start = profile != NULL ? SDM_now_ns() : 0;
 
   for (size_t i=0; i<num_data_pts; i++) {
+    // The value is parsed first so that rows dropped by the change filter never have their
+    // timestamps converted
+    double scalar_val = NAN;
+    DynScalarArray elems = {0};
+    parse_db_value(PQgetvalue(res, i, 2), attr, dataset->type, arena, &scalar_val, &elems);
+
+    if (profile != NULL) {
+      uint64_t now = SDM_now_ns();
+      profile->phase_ns[PHASE_VALUE_PARSING] += now - phase_start;
+      phase_start = now;
+      for (int field=0; field<PQnfields(res); field++) {
+        profile->bytes_received += (size_t)PQgetlength(res, i, field);
+      }
+    }
+
+    if (filter_changes && (dataset->time_array.length > 0 || have_seed)) {
+      bool changed;
+      if (dataset->type == DATATYPE_SCALAR) {
+        size_t n = dataset->as.scalar_array.length;
+        changed = scalar_changed(n > 0 ? dataset->as.scalar_array.data[n-1] : seed_scalar, scalar_val, opts);
+      } else {
+        size_t n = dataset->as.vector_array.length;
+        changed = vector_changed(n > 0 ? dataset->as.vector_array.data[n-1] : seed_elems, elems, opts);
+      }
+      if (!changed) continue;
+    }
+    last_kept_row = (long)i;
+
     struct tm time_struct = {0};
     char *time_str = PQgetvalue(res, i, 1);
 
@@ -231,89 +657,556 @@ int get_single_attr_data(
     time_struct.tm_isdst = is_summer_time ? 1 : 0;
     mktime(&time_struct); // Normalize the structure
 
-    SDM_ARRAY_PUSH(dataset->time_array, ((AccurateTime){.time_struct=time_struct, .micros=micros}));
+    if (profile != NULL) {
+      uint64_t now = SDM_now_ns();
+      profile->phase_ns[PHASE_TIME_CONVERSION] += now - phase_start;
+      phase_start = now;
+    }
 
-    char *db_val_str = PQgetvalue(res, i, 2);
-    if (dataset->type == DATATYPE_SCALAR) {
-      if (strcmp(attr.table, "att_scalar_devboolean")==0) {
-        if (strcmp(db_val_str, "t")==0) {
-          SDM_ARRAY_PUSH(dataset->as.scalar_array, 1.0);
-        } else if (strcmp(db_val_str, "f")==0) {
-          SDM_ARRAY_PUSH(dataset->as.scalar_array, 0.0);
-        } else {
-          assert(0 && "unreachable code was reached");
-        }
-      } else {
-        char *end_ptr;
-        double val = strtod(db_val_str, &end_ptr);
-        if (db_val_str == end_ptr)
-            val = NAN;
-        SDM_ARRAY_PUSH(dataset->as.scalar_array, val);
+    SDM_ARENA_PUSH(dataset->time_array, ((AccurateTime){.time_struct=time_struct, .micros=micros}));
+
+    if (dataset->type == DATATYPE_SCALAR) SDM_ARENA_PUSH(dataset->as.scalar_array, scalar_val);
+    else                                   SDM_ARENA_PUSH((dataset->as.vector_array), elems);
+  }
+
+  if (cursor != NULL && num_data_pts > 0) {
+    snprintf(cursor->last_time, sizeof(cursor->last_time), "%s", PQgetvalue(res, num_data_pts-1, 1));
+  }
+  // Only the deadband needs the last kept value to carry on from where it stopped
+  if (filter_changes && cursor != NULL && last_kept_row >= 0) {
+    free(cursor->last_value);
+    cursor->last_value = strdup(PQgetvalue(res, last_kept_row, 2));
+  }
+
+  PQclear(res);
+
+  if (profile != NULL) {
+    profile->rows_received += num_data_pts;
+    profile->rows_kept += dataset->time_array.length;
+  }
+
+  return num_data_pts;
+}
+
+void decimate_dataset(DataSet *ds, size_t factor, size_t first_row) {
+  // Keeps every factor'th point, compacting the arrays in place.  first_row is the number of rows
+  // that came before this dataset, so that batches of one attribute decimate as a whole would.
+  size_t total_datapoints = ds->time_array.length;
+  size_t kept = 0;
+  for (size_t index=(factor - first_row % factor) % factor; index<total_datapoints; index += factor, kept++) {
+    ds->time_array.data[kept] = ds->time_array.data[index];
+    if (ds->type == DATATYPE_SCALAR)
+      ds->as.scalar_array.data[kept] = ds->as.scalar_array.data[index];
+    else
+      ds->as.vector_array.data[kept] = ds->as.vector_array.data[index];
+  }
+  ds->time_array.length = kept;
+  if (ds->type == DATATYPE_SCALAR) ds->as.scalar_array.length = kept;
+  else                             ds->as.vector_array.length = kept;
+}
+
+static int format_time(char *buf, size_t buf_size, AccurateTime t) {
+  return snprintf(buf, buf_size, "%02d-%02d-%02d_%02d:%02d:%02d.%06d",
+                  t.time_struct.tm_year+1900,
+                  t.time_struct.tm_mon+1,
+                  t.time_struct.tm_mday,
+                  t.time_struct.tm_hour,
+                  t.time_struct.tm_min,
+                  t.time_struct.tm_sec,
+                  t.micros);
+}
+
+static int lod_open_level(LodPyramid *lod, size_t level) {
+  LodLevel *l = &lod->levels[level];
+  size_t fname_size = strlen(lod->basename) + 32;
+  char *fname = malloc(fname_size * sizeof(char));
+  if (fname == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    return -1;
+  }
+
+  if (level == 0) {
+    snprintf(fname, fname_size, "%s.idx", lod->basename);
+  } else {
+    snprintf(fname, fname_size, "%s_lod%zu.dat", lod->basename, level);
+    // Binary like the main file, so that the offsets counted from fprintf match the file
+    l->data_stream = fopen(fname, "wb");
+    if (l->data_stream == NULL) {
+      fprintf(stderr, "ERROR: Could not open %s: %s\n", fname, strerror(errno));
+      FREE(fname);
+      return -1;
+    }
+    l->offset += fprintf(l->data_stream, "\"# DATASET= %s\"\n", lod->dataset_name);
+    l->offset += fprintf(l->data_stream, "\"# LOD_LEVEL= %zu FACTOR= %zu\"\n", level, lod->factor);
+    snprintf(fname, fname_size, "%s_lod%zu.idx", lod->basename, level);
+  }
+
+  l->index_stream = fopen(fname, "wb");
+  if (l->index_stream == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", fname, strerror(errno));
+    FREE(fname);
+    return -1;
+  }
+
+  FREE(fname);
+  return 0;
+}
+
+static void lod_index_row(LodLevel *l, AccurateTime time) {
+  if (l->index_stream != NULL && l->rows % LOD_INDEX_STRIDE == 0) {
+    char time_str[128];
+    format_time(time_str, sizeof(time_str), time);
+    fprintf(l->index_stream, "%s %zu %ld\n", time_str, l->rows, l->offset);
+  }
+}
+
+static void lod_accumulate(LodPyramid *lod, size_t level, LodBlock block);
+
+static void lod_emit(LodPyramid *lod, size_t level, LodBlock block) {
+  LodLevel *l = &lod->levels[level];
+  if (l->failed) return;
+  if (l->data_stream == NULL && lod_open_level(lod, level) != 0) {
+    l->failed = true;
+    lod->failed = true;
+    return;
+  }
+
+  double mean = block.num_valid > 0 ? block.sum / (double)block.num_valid : NAN;
+  char time_str[128];
+  format_time(time_str, sizeof(time_str), block.time);
+
+  lod_index_row(l, block.time);
+  l->offset += fprintf(l->data_stream, "%s %0.11f %0.11f %0.11f\n",
+                       time_str, block.min, block.max, mean);
+  l->rows++;
+
+  if (level + 1 < LOD_MAX_LEVELS) lod_accumulate(lod, level + 1, block);
+}
+
+static void lod_accumulate(LodPyramid *lod, size_t level, LodBlock block) {
+  LodLevel *l = &lod->levels[level];
+  if (l->acc_count == 0) {
+    l->acc = (LodBlock){.time=block.time, .min=NAN, .max=NAN, .sum=0.0, .num_valid=0};
+  }
+  if (block.num_valid > 0) {
+    if (l->acc.num_valid == 0 || block.min < l->acc.min) l->acc.min = block.min;
+    if (l->acc.num_valid == 0 || block.max > l->acc.max) l->acc.max = block.max;
+    l->acc.sum += block.sum;
+    l->acc.num_valid += block.num_valid;
+  }
+  l->acc_count++;
+
+  if (l->acc_count == lod->factor) {
+    l->acc_count = 0;
+    lod_emit(lod, level, l->acc);
+  }
+}
+
+int lod_open(LodPyramid *lod, const char *basename, const char *dataset_name, size_t factor) {
+  memset(lod, 0, sizeof(*lod));
+  lod->basename = strdup(basename);
+  lod->dataset_name = strdup(dataset_name);
+  lod->factor = factor;
+  if (lod->basename == NULL || lod->dataset_name == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    lod_close(lod);
+    return -1;
+  }
+  // Level 0 only needs an index, its data is the main output file
+  if (lod_open_level(lod, 0) != 0) {
+    lod_close(lod);
+    return -1;
+  }
+  return 0;
+}
+
+void lod_add_sample(LodPyramid *lod, AccurateTime time, double value, long offset) {
+  LodLevel *l = &lod->levels[0];
+  l->offset = offset;
+  lod_index_row(l, time);
+  l->rows++;
+
+  LodBlock block = {.time=time, .min=value, .max=value, .sum=value, .num_valid=1};
+  if (isnan(value)) block = (LodBlock){.time=time, .min=NAN, .max=NAN, .sum=0.0, .num_valid=0};
+  lod_accumulate(lod, 1, block);
+}
+
+int lod_close(LodPyramid *lod) {
+  // Flush the partial blocks at the end of each level, but only into levels that already exist.
+  // A level that never filled a single block would duplicate the one below it.  Returns -1 if any
+  // level could not be written.
+  for (size_t level=1; level<LOD_MAX_LEVELS; level++) {
+    LodLevel *l = &lod->levels[level];
+    if (l->acc_count > 0 && l->rows > 0) {
+      l->acc_count = 0;
+      lod_emit(lod, level, l->acc);
+    }
+  }
+
+  for (size_t level=0; level<LOD_MAX_LEVELS; level++) {
+    LodLevel *l = &lod->levels[level];
+    if (l->data_stream != NULL)  fclose(l->data_stream);
+    if (l->index_stream != NULL) fclose(l->index_stream);
+  }
+  int result = lod->failed ? -1 : 0;
+  if (lod->basename)     FREE(lod->basename);
+  if (lod->dataset_name) FREE(lod->dataset_name);
+  memset(lod, 0, sizeof(*lod));
+  return result;
+}
+
+int checkpoint_load(Checkpoint *cp, const char *file_path) {
+  // After a "# QUERY= <options>" line, each line is
+  //   <file number> <done|partial> <bytes> <rows kept> <last data_time> <last value> <name>
+  // separated by tabs, with the last time and value left empty until the first rows arrive
+  int result = 0;
+  FILE *f = fopen(file_path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open checkpoint %s: %s\n", file_path, strerror(errno));
+    return -1;
+  }
+  fclose(f);
+
+  memset(cp, 0, sizeof(*cp));
+  cp->file_path = strdup(file_path);
+  char *contents = SDM_read_entire_file(file_path);
+  SDM_StringView sv = SDM_cstr_as_sv(contents);
+  size_t line_num = 0;
+
+  while (sv.length > 0) {
+    SDM_StringView line = SDM_sv_pop_by_delim(&sv, '\n');
+    line_num++;
+    if (line.length == 0) continue;
+    if (line.data[0] == '#') {
+      const char *prefix = "# QUERY= ";
+      size_t prefix_len = strlen(prefix);
+      if (line.length >= prefix_len && strncmp(line.data, prefix, prefix_len) == 0) {
+        FREE(cp->query);
+        cp->query = sv_to_cstr(SDM_sized_str_as_sv(line.data + prefix_len, line.length - prefix_len));
       }
-    } else if (dataset->type == DATATYPE_VECTOR) {
-      SDM_ARRAY_PUSH((dataset->as.vector_array), (DynScalarArray){0});
-      size_t item_number = dataset->as.vector_array.length - 1;
-      if (*db_val_str == '{') db_val_str++;
-      while (*db_val_str != '}') {
-        char *end_ptr;
-        double val = strtod(db_val_str, &end_ptr);
-        if (db_val_str == end_ptr)
-            val = NAN;
-        db_val_str = end_ptr;
-        SDM_ARRAY_PUSH((dataset->as.vector_array.data[item_number]), val);
-        while (*db_val_str == ',') {
-          db_val_str++;
+      continue;
+    }
+
+    SDM_StringView fields[7];
+    for (size_t i=0; i<7; i++) fields[i] = SDM_sv_pop_by_delim(&line, i < 6 ? '\t' : '\n');
+    char *number = sv_to_cstr(fields[0]);
+    char *bytes = sv_to_cstr(fields[2]);
+    char *rows = sv_to_cstr(fields[3]);
+    char *end_num, *end_bytes, *end_rows;
+    size_t file_num = strtoul(number, &end_num, 10);
+    long num_bytes = strtol(bytes, &end_bytes, 10);
+    size_t num_rows = strtoul(rows, &end_rows, 10);
+    bool ok = *number != '\0' && *end_num == '\0' && *bytes != '\0' && *end_bytes == '\0' && num_bytes >= 0 &&
+              *rows != '\0' && *end_rows == '\0' && file_num == cp->length + 1 &&
+              fields[4].length < DB_TIME_LENGTH && fields[6].length > 0;
+    FREE(number);
+    FREE(bytes);
+    FREE(rows);
+    if (!ok) {
+      fprintf(stderr, "ERROR: %s:%zu: Could not parse checkpoint entry\n", file_path, line_num);
+      defered_return(-1);
+    }
+
+    CheckpointEntry entry = {
+      .name=sv_to_cstr(fields[6]),
+      .complete=fields[1].length == 4 && strncmp(fields[1].data, "done", 4) == 0,
+      .bytes=num_bytes,
+      .rows_kept=num_rows,
+    };
+    memcpy(entry.cursor.last_time, fields[4].data, fields[4].length);
+    if (fields[5].length > 0) entry.cursor.last_value = sv_to_cstr(fields[5]);
+    SDM_ARRAY_PUSH((*cp), entry);
+  }
+
+  if (cp->query == NULL) {
+    fprintf(stderr, "ERROR: %s is not a checkpoint manifest\n", file_path);
+    defered_return(-1);
+  }
+
+defer:
+  FREE(contents);
+  return result;
+}
+
+int checkpoint_save(const Checkpoint *cp) {
+  // Written to a temporary file that then replaces the manifest, so that a crash part way through
+  // leaves the previous manifest intact
+  int result = 0;
+  char *tmp_path = malloc(strlen(cp->file_path) + 5);
+  if (tmp_path == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    return -1;
+  }
+  sprintf(tmp_path, "%s.tmp", cp->file_path);
+  FILE *f = fopen(tmp_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", tmp_path, strerror(errno));
+    defered_return(-1);
+  }
+
+  fprintf(f, "# QUERY= %s\n", cp->query);
+  for (size_t i=0; i<cp->length; i++) {
+    const CheckpointEntry *entry = &cp->data[i];
+    fprintf(f, "%zu\t%s\t%ld\t%zu\t%s\t%s\t%s\n", i+1, entry->complete ? "done" : "partial",
+            entry->bytes, entry->rows_kept, entry->cursor.last_time,
+            entry->cursor.last_value ? entry->cursor.last_value : "", entry->name);
+  }
+  if (SDM_sync_file(f) != 0 || ferror(f)) {
+    fprintf(stderr, "ERROR: Could not write %s: %s\n", tmp_path, strerror(errno));
+    fclose(f);
+    defered_return(-1);
+  }
+  fclose(f);
+
+  if (SDM_replace_file(tmp_path, cp->file_path) != 0) {
+    fprintf(stderr, "ERROR: Could not replace %s: %s\n", cp->file_path, strerror(errno));
+    defered_return(-1);
+  }
+
+defer:
+  FREE(tmp_path);
+  return result;
+}
+
+void checkpoint_update(CheckpointEntry *entry, long bytes, size_t rows_kept, const FetchCursor *cursor,
+                       bool complete) {
+  entry->bytes = bytes;
+  entry->rows_kept = rows_kept;
+  entry->complete = complete;
+  snprintf(entry->cursor.last_time, sizeof(entry->cursor.last_time), "%s", cursor->last_time);
+  if (entry->cursor.last_value != cursor->last_value) {
+    free(entry->cursor.last_value);
+    entry->cursor.last_value = cursor->last_value ? strdup(cursor->last_value) : NULL;
+  }
+}
+
+void checkpoint_free(Checkpoint *cp) {
+  for (size_t i=0; i<cp->length; i++) {
+    FREE(cp->data[i].name);
+    FREE(cp->data[i].cursor.last_value);
+  }
+  SDM_ARRAY_FREE((*cp));
+  FREE(cp->file_path);
+  FREE(cp->query);
+}
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} TextBuffer;
+
+typedef struct {
+  size_t *data;
+  size_t length;
+  size_t capacity;
+} RowEnds;
+
+// A range of rows formatted into its own buffer, so that ranges can be formatted in parallel and
+// then written out in order
+typedef struct {
+  size_t chunk_num;
+  size_t first_row;
+  size_t num_rows;
+  size_t estimated_bytes;
+  bool ready;
+  TextBuffer text;
+  RowEnds row_ends;
+} FormatChunk;
+
+// The formatting threads of one write_dataset_to_stream call.  They take chunks of about
+// FORMAT_CHUNK_BYTES of text in order, chunk k going into slot k % num_slots, while the calling
+// thread writes the finished chunks out in order.  A slot is only reused once its chunk has been
+// written, and there are at most FORMAT_POOL_BYTES / FORMAT_CHUNK_BYTES slots, which bounds the
+// memory used.
+typedef struct {
+  const DataSet *ds;
+  bool record_row_ends;
+  size_t total_rows;
+  size_t next_row;
+  size_t next_chunk;
+  FormatChunk *slots;
+  size_t num_slots;
+  size_t num_written;
+  SDM_Mutex lock;
+  SDM_Cond formatted;
+  SDM_Cond written;
+} FormatPool;
+
+static void text_printf(TextBuffer *text, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(text->data + text->length, text->capacity - text->length, fmt, args);
+  va_end(args);
+  if (n < 0) return;
+  if ((size_t)n >= text->capacity - text->length) {
+    SDM_ENSURE_ARRAY_MIN_CAP((*text), 2*text->capacity + n + 1);
+    va_start(args, fmt);
+    vsnprintf(text->data + text->length, text->capacity - text->length, fmt, args);
+    va_end(args);
+  }
+  text->length += n;
+}
+
+static size_t estimate_row_bytes(const DataSet *ds, size_t row) {
+  // A timestamp and a typical value, or up to 26 bytes for each ", %.17g" of a vector
+  if (ds->type == DATATYPE_SCALAR) return 48;
+  return 32 + 26 * ds->as.vector_array.data[row].length;
+}
+
+static size_t claim_chunk(FormatPool *pool, size_t *first_row, size_t *num_rows, size_t *estimated_bytes) {
+  // Takes the next rows worth about FORMAT_CHUNK_BYTES of text (at least one row, however wide),
+  // returning the chunk's number.  Called with the lock held.
+  size_t row = pool->next_row;
+  size_t bytes = 0;
+  while (row < pool->total_rows && bytes < FORMAT_CHUNK_BYTES) bytes += estimate_row_bytes(pool->ds, row++);
+  *first_row = pool->next_row;
+  *num_rows = row - pool->next_row;
+  *estimated_bytes = bytes;
+  pool->next_row = row;
+  return pool->next_chunk++;
+}
+
+static void format_chunk(const FormatPool *pool, FormatChunk *chunk) {
+  const DataSet *ds = pool->ds;
+  chunk->text.length = 0;
+  chunk->row_ends.length = 0;
+  // text_printf grows the buffer if the estimate was short
+  SDM_ENSURE_ARRAY_MIN_CAP(chunk->text, chunk->estimated_bytes + 1);
+  if (pool->record_row_ends) SDM_ENSURE_ARRAY_MIN_CAP(chunk->row_ends, chunk->num_rows);
+
+  for (size_t data_pt=chunk->first_row; data_pt < chunk->first_row + chunk->num_rows; data_pt++) {
+    char time_str[128];
+    format_time(time_str, sizeof(time_str), ds->time_array.data[data_pt]);
+
+    switch (ds->type) {
+      case DATATYPE_SCALAR: {
+        text_printf(&chunk->text, "%s %0.11f\n", time_str, ds->as.scalar_array.data[data_pt]);
+      } break;
+      case DATATYPE_VECTOR: {
+        DynScalarArray d = ds->as.vector_array.data[data_pt];
+        text_printf(&chunk->text, "%s [", time_str);
+        for (size_t subpt=0; subpt<d.length; subpt++) {
+          if (subpt==0) {
+            text_printf(&chunk->text, "%.17g", d.data[subpt]);
+          } else {
+            text_printf(&chunk->text, ", %.17g", d.data[subpt]);
+          }
         }
-      }
-      fprintf(stderr, "%s\n", db_val_str);
-      // fprintf(stderr, "\nWARNING: Vector acquisition is not implemented.\n\n");
-      // break;
+        text_printf(&chunk->text, "]\n");
+      } break;
     }
+    if (pool->record_row_ends) chunk->row_ends.data[chunk->row_ends.length++] = chunk->text.length;
   }
+}
 
-  PQclear(res);
+static void release_chunk(FormatChunk *chunk) {
+  // Drops a buffer that a very wide row, or a short estimate, blew up, so that the slot doesn't
+  // keep that much memory for the rest of the dataset
+  if (chunk->text.capacity > 2 * FORMAT_CHUNK_BYTES) SDM_ARRAY_FREE(chunk->text);
+}
 
-  return num_data_pts;
+static void *format_worker(void *arg) {
+  FormatPool *pool = arg;
+  SDM_mutex_lock(&pool->lock);
+  while (pool->next_row < pool->total_rows) {
+    size_t first_row, num_rows, estimated_bytes;
+    size_t chunk_num = claim_chunk(pool, &first_row, &num_rows, &estimated_bytes);
+    while (chunk_num >= pool->num_written + pool->num_slots) SDM_cond_wait(&pool->written, &pool->lock);
+    FormatChunk *chunk = &pool->slots[chunk_num % pool->num_slots];
+    chunk->chunk_num = chunk_num;
+    chunk->first_row = first_row;
+    chunk->num_rows = num_rows;
+    chunk->estimated_bytes = estimated_bytes;
+    SDM_mutex_unlock(&pool->lock);
+
+    format_chunk(pool, chunk);
+
+    SDM_mutex_lock(&pool->lock);
+    chunk->ready = true;
+    SDM_cond_broadcast(&pool->formatted);
+  }
+  SDM_mutex_unlock(&pool->lock);
+  return NULL;
 }
 
-void write_dataset_to_stream(FILE *stream, DataSet ds) {
+size_t write_dataset_to_stream(FILE *stream, DataSet ds, LodPyramid *lod, size_t num_threads) {
+    // Returns the number of bytes of rows written
     size_t total_datapoints = ds.type==DATATYPE_SCALAR ? 
       ds.as.scalar_array.length : ds.as.vector_array.length;
-    for (size_t data_pt=0; data_pt < total_datapoints; data_pt++) {
-      DynTimeArray t = ds.time_array;
-      char time_str[128];
-      memset(time_str, 0, sizeof(time_str)/sizeof(char));
-      sprintf(time_str, "%02d-%02d-%02d_%02d:%02d:%02d.%06d",
-              t.data[data_pt].time_struct.tm_year+1900,
-              t.data[data_pt].time_struct.tm_mon+1,
-              t.data[data_pt].time_struct.tm_mday,
-              t.data[data_pt].time_struct.tm_hour,
-              t.data[data_pt].time_struct.tm_min,
-              t.data[data_pt].time_struct.tm_sec,
-              t.data[data_pt].micros);
-
-      fprintf(stream, "%s ", time_str);
-      switch (ds.type) {
-        case DATATYPE_SCALAR: {
-          DynScalarArray d = ds.as.scalar_array;
-          fprintf(stream, "%0.11f\n", d.data[data_pt]);
-        } break;
-        case DATATYPE_VECTOR: {
-          DynVectorArray d = ds.as.vector_array;
-          fprintf(stream, "[");
-          for (size_t subpt=0; subpt<d.data[data_pt].length; subpt++) {
-            if (subpt==0) {
-              fprintf(stream, "%.17g", d.data[data_pt].data[subpt]);
-            } else {
-              fprintf(stream, ", %.17g", d.data[data_pt].data[subpt]);
-            }
-          }
-          fprintf(stream, "]\n");
-        } break;
+    if (ds.type != DATATYPE_SCALAR) lod = NULL;
+    long offset = lod != NULL ? ftell(stream) : 0;
+
+    FormatPool pool = {
+      .ds=&ds,
+      .record_row_ends=lod != NULL,
+      .total_rows=total_datapoints,
+      .lock=SDM_MUTEX_INIT,
+      .formatted=SDM_COND_INIT,
+      .written=SDM_COND_INIT,
+    };
+    // No more threads than there are chunks, or than there are slots for under FORMAT_POOL_BYTES
+    size_t total_bytes = 0;
+    for (size_t row=0; row<total_datapoints; row++) total_bytes += estimate_row_bytes(&ds, row);
+    size_t num_chunks = (total_bytes + FORMAT_CHUNK_BYTES - 1) / FORMAT_CHUNK_BYTES;
+    size_t max_slots = FORMAT_POOL_BYTES / FORMAT_CHUNK_BYTES;
+    if (num_threads > num_chunks) num_threads = num_chunks;
+    if (num_threads > max_slots) num_threads = max_slots;
+
+    // With a single thread, or if no threads can be started, the chunks are formatted here instead
+    SDM_Thread *threads = num_threads > 1 ? calloc(num_threads, sizeof(SDM_Thread)) : NULL;
+    pool.num_slots = threads != NULL ? 2 * num_threads : 1;
+    if (pool.num_slots > max_slots) pool.num_slots = max_slots;
+    pool.slots = calloc(pool.num_slots, sizeof(FormatChunk));
+    if (pool.slots == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory.\n");
+      if (threads) FREE(threads);
+      return 0;
+    }
+    size_t num_started = threads != NULL ? SDM_start_threads(threads, format_worker, &pool, 0, num_threads) : 0;
+
+    size_t bytes_written = 0;
+    size_t rows_written = 0;
+    for (size_t chunk_num=0; rows_written < total_datapoints; chunk_num++) {
+      FormatChunk *chunk = &pool.slots[chunk_num % pool.num_slots];
+      if (num_started == 0) {
+        chunk->chunk_num = claim_chunk(&pool, &chunk->first_row, &chunk->num_rows, &chunk->estimated_bytes);
+        format_chunk(&pool, chunk);
+      } else {
+        SDM_mutex_lock(&pool.lock);
+        while (!chunk->ready || chunk->chunk_num != chunk_num) SDM_cond_wait(&pool.formatted, &pool.lock);
+        SDM_mutex_unlock(&pool.lock);
+      }
+
+      if (lod != NULL) {
+        for (size_t row=0; row<chunk->row_ends.length; row++) {
+          size_t data_pt = chunk->first_row + row;
+          long row_offset = offset + (long)(row == 0 ? 0 : chunk->row_ends.data[row - 1]);
+          lod_add_sample(lod, ds.time_array.data[data_pt], ds.as.scalar_array.data[data_pt], row_offset);
+        }
+      }
+      fwrite(chunk->text.data, 1, chunk->text.length, stream);
+      offset += (long)chunk->text.length;
+      bytes_written += chunk->text.length;
+      rows_written += chunk->num_rows;
+      release_chunk(chunk);
+
+      if (num_started > 0) {
+        SDM_mutex_lock(&pool.lock);
+        chunk->ready = false;
+        pool.num_written++;
+        SDM_cond_broadcast(&pool.written);
+        SDM_mutex_unlock(&pool.lock);
       }
     }
 
-    if (stream == stdout)
-        fprintf(stream, "\n");
-}
+    for (size_t i=0; i<num_started; i++) SDM_thread_join(threads[i]);
+    if (threads) FREE(threads);
+    for (size_t i=0; i<pool.num_slots; i++) {
+      SDM_ARRAY_FREE(pool.slots[i].text);
+      SDM_ARRAY_FREE(pool.slots[i].row_ends);
+    }
+    FREE(pool.slots);
 
+    return bytes_written;
+}
@@ -3,14 +3,18 @@
 
 #define _XOPEN_SOURCE 700
 
+#include<stdio.h>
 #include<time.h>
 
 #include "libpq-fe.h"
+#include "sdm_lib.h"
 
 #define ATTR_ID_LENGTH 32
 #define ATTR_NAME_LENGTH 256
 #define ATTR_TABLE_LENGTH 64
 #define MAX_ARRAY_LENGTH (1024*1024*1024 / 8)
+#define FORMAT_CHUNK_BYTES (4*1024*1024)
+#define FORMAT_POOL_BYTES (64*1024*1024)
 
 typedef struct {
   char id[ATTR_ID_LENGTH];
@@ -24,6 +28,18 @@ typedef struct {
     ArchiverAttr *data;
 } ArchiverAttrs;
 
+// An archiver database.  conninfo is anything libpq accepts: a URI or keyword/value pairs.
+typedef struct {
+  char *name;
+  char *conninfo;
+} DbEndpoint;
+
+typedef struct {
+  DbEndpoint *data;
+  size_t length;
+  size_t capacity;
+} DbEndpoints;
+
 typedef struct {
   struct tm time_struct;
   int micros;
@@ -47,6 +63,12 @@ typedef struct {
   size_t capacity;
 } DynTimeArray;
 
+typedef struct {
+  size_t *data;
+  size_t length;
+  size_t capacity;
+} DynIndexArray;
+
 typedef enum {
   DATATYPE_SCALAR,
   DATATYPE_VECTOR,
@@ -59,6 +81,8 @@ typedef struct {
     DynScalarArray scalar_array;
     DynVectorArray vector_array;
   } as;
+  // Original array index of each element of a vector point, or empty if the whole array was fetched
+  DynIndexArray element_indices;
 } DataSet;
 
 typedef struct {
@@ -67,9 +91,150 @@ typedef struct {
   size_t capacity;
 } DynDataSetArray;
 
+typedef struct {
+  size_t rows;
+  size_t bytes;
+} AttrEstimate;
+
+// Zero-based, half-open range [start, stop) of array elements to fetch.  No index may reach
+// MAX_SELECTED_ELEMENTS, and neither may the number of elements selected in total.
+#define MAX_SELECTED_ELEMENTS (1024*1024)
+
+typedef struct {
+  size_t start;
+  size_t stop;
+} ElementRange;
+
+typedef struct {
+  ElementRange *data;
+  size_t length;
+  size_t capacity;
+} ElementRanges;
+
+typedef struct {
+  ElementRanges elements;
+  // Only keep rows whose value changed by more than the deadband (absolute, or a fraction of the
+  // last kept value when deadband_relative is set)
+  bool changes_only;
+  double deadband;
+  bool deadband_relative;
+} QueryOptions;
+
+// Where a batched fetch of one attribute has got to.  last_time is the data_time of the last row
+// received, as the server sent it, and last_value the value of the last row kept (for the
+// deadband).  Both are empty until the first rows arrive.
+#define DB_TIME_LENGTH 64
+
+typedef struct {
+  size_t batch_rows;
+  char last_time[DB_TIME_LENGTH];
+  char *last_value;
+} FetchCursor;
+
+// Checkpoint manifest of an export to files.  For each attribute, in file number order, it holds
+// how many bytes of the .dat file are safely on disk and where the fetch had got to when they
+// were written.  It is replaced after every batch so that an interrupted export can be resumed.
+typedef struct {
+  char *name;
+  bool complete;
+  long bytes;
+  // Rows kept before decimation, so that a resumed export decimates the same rows
+  size_t rows_kept;
+  FetchCursor cursor;
+} CheckpointEntry;
+
+typedef struct {
+  char *file_path;
+  // The options that decide what goes in the files, which a resume has to repeat
+  char *query;
+  CheckpointEntry *data;
+  size_t length;
+  size_t capacity;
+} Checkpoint;
+
+int checkpoint_load(Checkpoint *cp, const char *file_path);
+int checkpoint_save(const Checkpoint *cp);
+void checkpoint_update(CheckpointEntry *entry, long bytes, size_t rows_kept, const FetchCursor *cursor,
+                       bool complete);
+void checkpoint_free(Checkpoint *cp);
+
+// Phases timed by --profile.  PHASE_SERVER runs from sending a query until the first bytes of
+// the reply arrive, and PHASE_TRANSFER from then until the whole result has been received.
+typedef enum {
+  PHASE_CONNECT,
+  PHASE_RESOLVE,
+  PHASE_ESTIMATE,
+  PHASE_SERVER,
+  PHASE_TRANSFER,
+  PHASE_TIME_CONVERSION,
+  PHASE_VALUE_PARSING,
+  PHASE_DECIMATION,
+  PHASE_WRITING,
+  PHASE_COUNT,
+} ProfilePhase;
+
+extern const char *profile_phase_names[PHASE_COUNT];
+
+typedef struct {
+  uint64_t phase_ns[PHASE_COUNT];
+  size_t rows_received;
+  size_t rows_kept;
+  size_t bytes_received;
+  size_t bytes_written;
+  size_t arena_regions;
+} Profile;
+
+void profile_add(Profile *total, const Profile *p);
+
+// Level-of-detail pyramid written alongside a scalar dataset.  Level 0 is the dataset itself;
+// level k holds min/max/mean over blocks of `factor` rows of level k-1.  Every level gets an
+// index file mapping the time of every LOD_INDEX_STRIDE'th row to its byte offset in the data.
+#define LOD_MAX_LEVELS 16
+#define LOD_INDEX_STRIDE 1024
+
+typedef struct {
+  AccurateTime time;
+  double min;
+  double max;
+  double sum;
+  size_t num_valid;
+} LodBlock;
+
+typedef struct {
+  FILE *data_stream;
+  FILE *index_stream;
+  size_t rows;
+  long offset;
+  LodBlock acc;
+  size_t acc_count;
+  // Set once the level's files could not be opened, so that it is not tried again
+  bool failed;
+} LodLevel;
+
+typedef struct {
+  char *basename;
+  char *dataset_name;
+  size_t factor;
+  LodLevel levels[LOD_MAX_LEVELS];
+  bool failed;
+} LodPyramid;
+
+int lod_open(LodPyramid *lod, const char *basename, const char *dataset_name, size_t factor);
+void lod_add_sample(LodPyramid *lod, AccurateTime time, double value, long offset);
+int lod_close(LodPyramid *lod);
+
+int read_db_config(const char *file_path, DbEndpoints *endpoints);
+void free_db_endpoints(DbEndpoints *endpoints);
+PGconn *connect_to_endpoint(const DbEndpoint *endpoint, const char *password);
+bool attr_is_scalar(ArchiverAttr attr);
 int get_ids_and_tables(PGconn *conn, const char *search_string, ArchiverAttrs *attrs);
-int get_single_attr_data(PGconn *conn, ArchiverAttr attr, DataSet *dataset, struct tm start, struct tm stop);
-void write_dataset_to_stream(FILE *stream, DataSet ds);
+int estimate_attr_rows(PGconn *conn, ArchiverAttr attr, struct tm start, struct tm stop,
+                       AttrEstimate *estimate);
+int parse_element_ranges(const char *spec, ElementRanges *ranges);
+int get_single_attr_data(PGconn *conn, ArchiverAttr attr, DataSet *dataset, struct tm start, struct tm stop,
+                         const QueryOptions *opts, FetchCursor *cursor, SDM_Arena *arena, Profile *profile);
+void decimate_dataset(DataSet *ds, size_t factor, size_t first_row);
+size_t write_dataset_to_stream(FILE *stream, DataSet ds, LodPyramid *lod, size_t num_threads);
 
 #endif // !_LIB_H
 
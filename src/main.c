@@ -1,6 +1,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +10,25 @@
 #include "sdm_lib.h"
 #include "lib.h"
 
+#define DEFAULT_BATCH_ROWS (1024*1024)
+#define RECONNECT_ATTEMPTS 6
+
 void usage(FILE *sink, char *program_name) {
-  fprintf(sink, "%s --start/-s <start> --end/-e <end> [--file/-f <fname>] <attr> [--decimate <factor>]\n", 
+  fprintf(sink, "%s --start/-s <start> --end/-e <end> [--file/-f <fname>] <attr> [--decimate <factor>] [--pyramid <factor>]\n", 
           program_name);
   fprintf(sink, "\t<start> and <end> should be given in the format: %%Y-%%m-%%dT%%H:%%M:%%S\n");
+  fprintf(sink, "\t--config/-c <file> reads the databases to search from <file>, one \"<name> <connection string>\" per line\n");
+  fprintf(sink, "\t--jobs/-j <n> fetches with <n> parallel connections per database (into files, largest attributes first)\n");
+  fprintf(sink, "\t--memory-limit <MB> warns when the estimated peak memory use is over <MB> (default: the physical memory)\n");
+  fprintf(sink, "\t--threads <n> formats the output on <n> threads (default: the CPUs shared out between the --jobs workers)\n");
+  fprintf(sink, "\t--elements <sel> fetches only the given elements of array attributes, e.g. 0:16,42\n");
+  fprintf(sink, "\t\t(zero-based, <start>:<stop> excludes <stop>)\n");
+  fprintf(sink, "\t--changes-only only outputs rows where the value changed from the previous one\n");
+  fprintf(sink, "\t--deadband <d>[%%] only counts changes bigger than <d>, or <d> percent of the last value\n");
+  fprintf(sink, "\t--resume carries on an interrupted export to --file from its checkpoint, <fname>.manifest\n");
+  fprintf(sink, "\t--batch <n> fetches <n> rows at a time, checkpointing files after each (default: %d)\n", DEFAULT_BATCH_ROWS);
+  fprintf(sink, "\t--profile <file> times each phase of the export and writes a JSON report to <file>\n");
+  fprintf(sink, "\t--pyramid also writes min/max/mean reductions by <factor> per level, with time indices (needs --file)\n");
   return;
 }
 
@@ -31,6 +47,17 @@ typedef struct {
   bool verbose;
   bool decimate;
   int decimate_factor;
+  bool pyramid;
+  int pyramid_factor;
+  QueryOptions query_opts;
+  int num_workers;
+  char *config_file;
+  int num_format_threads;
+  int memory_limit_mb;
+  char *profile_file;
+  char *elements_arg;
+  bool resume;
+  int batch_rows;
 } InputArgs;
 
 void print_tm(const struct tm *t) {
@@ -92,27 +119,534 @@ void print_input_args(const InputArgs* args) {
     }
 }
 
+int parse_deadband(const char *arg, QueryOptions *opts) {
+  // A deadband implies --changes-only
+  if (arg == NULL) {
+    fprintf(stderr, "ERROR: No deadband given\n");
+    return -1;
+  }
+  char *end_ptr;
+  opts->deadband = strtod(arg, &end_ptr);
+  opts->deadband_relative = *end_ptr == '%';
+  if (opts->deadband_relative) {
+    opts->deadband /= 100.0;
+    end_ptr++;
+  }
+  if (end_ptr == arg || *end_ptr != '\0' || !(opts->deadband >= 0.0)) {
+    fprintf(stderr, "ERROR: Could not parse deadband \"%s\"\n", arg);
+    return -1;
+  }
+  opts->changes_only = true;
+  return 0;
+}
+
+int parse_int_arg(const char *option, const char *arg, int *value) {
+  // Only checks that arg is a whole number, check_input_args decides whether it is a sensible one
+  if (arg == NULL) {
+    fprintf(stderr, "ERROR: No value given for %s\n", option);
+    return -1;
+  }
+  char *end_ptr;
+  errno = 0;
+  long number = strtol(arg, &end_ptr, 10);
+  if (end_ptr == arg || *end_ptr != '\0' || errno == ERANGE || number < INT_MIN || number > INT_MAX) {
+    fprintf(stderr, "ERROR: %s needs a whole number, not \"%s\"\n", option, arg);
+    return -1;
+  }
+  *value = (int)number;
+  return 0;
+}
+
 bool check_input_args(InputArgs inargs) {
   if (inargs.start_str==NULL) return false;
   if (inargs.stop_str==NULL) return false;
   if (inargs.search_strs.length==0) return false;
   if (inargs.save_to_file && (inargs.filename_arg==NULL)) return false;
   if (inargs.decimate && (inargs.decimate_factor <= 0)) return false;
+  if (inargs.num_workers <= 0) return false;
+  if (inargs.num_format_threads < 0) return false;
+  if (inargs.memory_limit_mb < 0) return false;
+  if (inargs.config_file && inargs.config_file[0] == '\0') return false;
+  if (inargs.profile_file && inargs.profile_file[0] == '\0') return false;
+  if (inargs.pyramid && (!inargs.save_to_file || inargs.pyramid_factor < 2)) return false;
+  if (inargs.batch_rows <= 0 || inargs.batch_rows > MAX_ARRAY_LENGTH) return false;
+  // The pyramid levels are built as the rows go past, so they can't be picked up part way
+  if (inargs.resume && (!inargs.save_to_file || inargs.pyramid)) return false;
   return true;
 }
 
+typedef struct {
+  size_t attr_num;
+  AttrEstimate estimate;
+} FetchJob;
+
+typedef struct {
+  FetchJob *data;
+  size_t length;
+  size_t capacity;
+} FetchJobs;
+
+// Datasets go to stdout one at a time and in the order of the search, whichever worker fetched
+// them first.  next_attr is the first attribute that hasn't been printed, failed or been dropped.
+typedef struct {
+  SDM_Mutex lock;
+  SDM_Cond turn;
+  bool *finished;
+  size_t num_attrs;
+  size_t next_attr;
+} StdoutOrder;
+
+static void stdout_wait_turn(StdoutOrder *order, size_t attr_num) {
+  SDM_mutex_lock(&order->lock);
+  while (order->next_attr != attr_num) SDM_cond_wait(&order->turn, &order->lock);
+  SDM_mutex_unlock(&order->lock);
+}
+
+static void stdout_finish(StdoutOrder *order, size_t attr_num) {
+  SDM_mutex_lock(&order->lock);
+  order->finished[attr_num] = true;
+  while (order->next_attr < order->num_attrs && order->finished[order->next_attr]) order->next_attr++;
+  SDM_cond_broadcast(&order->turn);
+  SDM_mutex_unlock(&order->lock);
+}
+
+// What --profile reports for each attribute
+typedef struct {
+  Profile profile;
+  size_t queue_num;
+  bool fetched;
+  int result;
+} AttrProfile;
+
+// One per database.  The attributes matching on that database are resolved and sized on `conn`,
+// which is then handed to the first of its fetch workers.  Jobs are handed out in order.  When
+// several workers export to files, that is largest estimate first, so that the biggest attributes
+// can't end up starting last and holding up the whole run.  Otherwise it is the att_conf_id order of
+// the search.
+typedef struct {
+  const InputArgs *input_args;
+  struct tm start_tm;
+  struct tm stop_tm;
+  const DbEndpoint *endpoint;
+  const char *password;
+  PGconn *conn;
+  ArchiverAttrs local_attrs;
+  const ArchiverAttrs *attrs;
+  FetchJobs jobs;
+  size_t next_job;
+  size_t workers_left;
+  SDM_Mutex jobs_lock;
+  StdoutOrder *stdout_order;
+  Checkpoint *checkpoint;
+  SDM_Mutex *checkpoint_lock;
+  // Connection, search and estimate times on this database, and the per-attribute profiles indexed
+  // like attrs, which stays NULL unless profiling
+  Profile profile;
+  AttrProfile *attr_profiles;
+  int result;
+} FetchQueue;
+
+typedef struct {
+  FetchQueue *queue;
+  PGconn *conn;
+  SDM_Arena arena;
+  Profile profile;
+  int result;
+} FetchWorker;
+
+static int compare_jobs_largest_first(const void *a, const void *b) {
+  const FetchJob *ja = a;
+  const FetchJob *jb = b;
+  if (ja->estimate.rows != jb->estimate.rows) return ja->estimate.rows < jb->estimate.rows ? 1 : -1;
+  return ja->attr_num < jb->attr_num ? -1 : (ja->attr_num > jb->attr_num);
+}
+
+static int compare_sizes_largest_first(const void *a, const void *b) {
+  size_t sa = *(const size_t *)a;
+  size_t sb = *(const size_t *)b;
+  return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+static size_t peak_estimate_bytes(const FetchQueue *queue, size_t num_workers) {
+  // The num_workers largest attributes of a database may all be held at once, whatever order the
+  // jobs are in.  Only one batch of an attribute is ever held.
+  const InputArgs *input_args = queue->input_args;
+  if (queue->jobs.length == 0) return 0;
+  size_t *bytes = malloc(queue->jobs.length * sizeof(size_t));
+  if (bytes == NULL) return 0;
+  for (size_t j=0; j<queue->jobs.length; j++) {
+    AttrEstimate estimate = queue->jobs.data[j].estimate;
+    if (estimate.rows > (size_t)input_args->batch_rows) {
+      estimate.bytes = estimate.bytes / estimate.rows * (size_t)input_args->batch_rows;
+    }
+    bytes[j] = estimate.bytes;
+  }
+  qsort(bytes, queue->jobs.length, sizeof(size_t), compare_sizes_largest_first);
+  size_t peak = 0;
+  for (size_t j=0; j<num_workers && j<queue->jobs.length; j++) peak += bytes[j];
+  FREE(bytes);
+  return peak;
+}
+
+bool reconnect_with_backoff(PGconn *conn, const char *db_name) {
+  // Waits 1, 2, 4, ... seconds before each of RECONNECT_ATTEMPTS attempts
+  for (int attempt=0; attempt<RECONNECT_ATTEMPTS; attempt++) {
+    unsigned delay_s = 1u << attempt;
+    fprintf(stderr, "WARNING: No connection to %s, retrying in %u s\n", db_name, delay_s);
+    SDM_sleep_ms(delay_s * 1000);
+    PQreset(conn);
+    if (PQstatus(conn) == CONNECTION_OK) return true;
+  }
+  return false;
+}
+
+void *resolve_endpoint(void *arg) {
+  FetchQueue *queue = arg;
+  const InputArgs *input_args = queue->input_args;
+
+  uint64_t phase_start = SDM_now_ns();
+  queue->conn = connect_to_endpoint(queue->endpoint, queue->password);
+  if (PQstatus(queue->conn) != CONNECTION_OK && input_args->resume) {
+    reconnect_with_backoff(queue->conn, queue->endpoint->name);
+  }
+  queue->profile.phase_ns[PHASE_CONNECT] += SDM_now_ns() - phase_start;
+  if (PQstatus(queue->conn) != CONNECTION_OK) {
+    fprintf(stderr, "ERROR: %s: %s", queue->endpoint->name, PQerrorMessage(queue->conn));
+    queue->result = 1;
+    return NULL;
+  }
+
+  phase_start = SDM_now_ns();
+  for (size_t i=0; i<input_args->search_strs.length; i++) {
+    if (get_ids_and_tables(queue->conn, input_args->search_strs.data[i], &queue->local_attrs) < 0) {
+      queue->result = 1;
+      return NULL;
+    }
+  }
+  queue->profile.phase_ns[PHASE_RESOLVE] += SDM_now_ns() - phase_start;
+
+  if (input_args->verbose) {
+      printf("INFO: Found %zu attribute(s) matching in %s\n",
+             queue->local_attrs.length, queue->endpoint->name);
+  }
+
+  // Estimate the size of every attribute before fetching anything, so that the peak memory use
+  // can be checked up front and the largest ones can be scheduled first
+  phase_start = SDM_now_ns();
+  for (size_t attr_num=0; attr_num<queue->local_attrs.length; attr_num++) {
+    const ArchiverAttr *attr = &queue->local_attrs.data[attr_num];
+    FetchJob job = {.attr_num=attr_num};
+    if (estimate_attr_rows(queue->conn, *attr, queue->start_tm, queue->stop_tm, &job.estimate) != 0) {
+      fprintf(stderr, "WARNING: Could not estimate the size of %s\n", attr->name);
+    }
+    if (input_args->verbose) {
+      printf("INFO: Estimated %zu rows (%zu bytes) for %s\n",
+             job.estimate.rows, job.estimate.bytes, attr->name);
+    }
+    SDM_ARRAY_PUSH(queue->jobs, job);
+  }
+  queue->profile.phase_ns[PHASE_ESTIMATE] += SDM_now_ns() - phase_start;
+  // Only files can take the attributes in any order, and with one worker it makes no difference
+  if (input_args->save_to_file && input_args->num_workers > 1) {
+    qsort(queue->jobs.data, queue->jobs.length, sizeof(queue->jobs.data[0]), compare_jobs_largest_first);
+  }
+
+  return NULL;
+}
+
+int process_attribute(FetchWorker *worker, size_t attr_num) {
+  int result = 0;
+  FetchQueue *queue = worker->queue;
+  const InputArgs *input_args = queue->input_args;
+  const ArchiverAttr *attr = &queue->attrs->data[attr_num];
+  FILE *stream = NULL;
+  char *filename = NULL;
+  LodPyramid lod = {0};
+  bool use_lod = false;
+  AttrProfile *attr_profile = queue->attr_profiles ? &queue->attr_profiles[attr_num] : NULL;
+  Profile *profile = attr_profile ? &attr_profile->profile : NULL;
+  size_t regions_before = worker->arena.num_regions;
+  uint64_t phase_start = 0;
+
+  // Everything is fetched in batches of --batch rows, so that no one query can be too long.  For
+  // files, each batch is on disk and checkpointed before the next is asked for.
+  CheckpointEntry *entry = input_args->save_to_file ? &queue->checkpoint->data[attr_num] : NULL;
+  FetchCursor cursor = {.batch_rows=(size_t)input_args->batch_rows};
+  size_t rows_kept = 0;
+  bool write_headers = true;
+  if (entry != NULL) {
+    if (entry->complete) {
+      if (input_args->verbose) fprintf(stderr, "INFO: %s was already exported, skipping\n", attr->name);
+      return 0;
+    }
+    memcpy(cursor.last_time, entry->cursor.last_time, sizeof(cursor.last_time));
+    if (entry->cursor.last_value) cursor.last_value = strdup(entry->cursor.last_value);
+    rows_kept = entry->rows_kept;
+    write_headers = entry->bytes == 0;
+  }
+
+  if (input_args->verbose) {
+      fprintf(stderr, "INFO: Querying the database for %s\n", attr->name);
+  }
+
+  if (input_args->save_to_file) {
+    filename = malloc((strlen(input_args->filename_arg) + 32) * sizeof(char));
+    if (filename == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory.\n");
+      defered_return(1);
+    }
+    sprintf(filename, "%s%04zu", input_args->filename_arg, attr_num+1);
+    if (input_args->pyramid && attr_is_scalar(*attr)) {
+      if (lod_open(&lod, filename, attr->name, (size_t)input_args->pyramid_factor) != 0) {
+        fprintf(stderr, "ERROR: Could not write the pyramid for %s\n", attr->name);
+        defered_return(1);
+      }
+      use_lod = true;
+    } else if (input_args->pyramid) {
+      fprintf(stderr, "WARNING: No pyramid is written for vector attribute %s\n", attr->name);
+    }
+    strcat(filename, ".dat");
+    // Binary, so that Windows doesn't turn "\n" into "\r\n" behind the byte offsets kept in the
+    // pyramid indices and the manifest
+    if (write_headers) {
+      stream = fopen(filename, "wb");
+    } else {
+      // Anything after the checkpoint may be a partly written batch, so it is cut off
+      stream = fopen(filename, "r+b");
+      if (stream != NULL && (SDM_truncate_file(stream, entry->bytes) != 0 || fseek(stream, 0, SEEK_END) != 0)) {
+        fprintf(stderr, "ERROR: Could not cut %s back to its checkpoint: %s\n", filename, strerror(errno));
+        defered_return(1);
+      }
+      if (input_args->verbose && stream != NULL) {
+        fprintf(stderr, "INFO: Resuming %s after %s\n", filename, entry->cursor.last_time);
+      }
+    }
+    if (stream == NULL) {
+      fprintf(stderr, "ERROR: Could not open %s: %s\n", filename, strerror(errno));
+      defered_return(1);
+    }
+  }
+
+  while (true) {
+    DataSet ds = {0};
+    int num_rows = get_single_attr_data(worker->conn, *attr, &ds, queue->start_tm, queue->stop_tm,
+                                        &input_args->query_opts, &cursor, &worker->arena,
+                                        profile);
+    if (num_rows < 0) {
+      // The cursor only moves on once a batch has arrived, so a lost batch can simply be asked for again
+      if (entry != NULL && PQstatus(worker->conn) == CONNECTION_BAD &&
+          reconnect_with_backoff(worker->conn, queue->endpoint->name)) {
+        continue;
+      }
+      fprintf(stderr, "ERROR: Could not get data for %s\n", attr->name);
+      defered_return(1);
+    }
+
+    phase_start = SDM_now_ns();
+    size_t batch_kept = ds.time_array.length;
+    if (input_args->decimate) decimate_dataset(&ds, (size_t)input_args->decimate_factor, rows_kept);
+    rows_kept += batch_kept;
+    if (profile) profile->phase_ns[PHASE_DECIMATION] += SDM_now_ns() - phase_start;
+
+    if (stream == NULL) {
+      stdout_wait_turn(queue->stdout_order, attr_num);
+      stream = stdout;
+    }
+
+    phase_start = SDM_now_ns();
+    if (write_headers) {
+      fprintf(stream, "\"# DATASET= %s\"\n", attr->name);
+      fprintf(stream, "\"# SNAPSHOT_TIME= \"\n");
+      if (ds.type == DATATYPE_VECTOR && ds.element_indices.length > 0) {
+        fprintf(stream, "\"# ELEMENTS=");
+        for (size_t i=0; i<ds.element_indices.length; i++) fprintf(stream, " %zu", ds.element_indices.data[i]);
+        fprintf(stream, "\"\n");
+      }
+      write_headers = false;
+    }
+
+    size_t bytes_written = write_dataset_to_stream(stream, ds, use_lod ? &lod : NULL,
+                                                   (size_t)input_args->num_format_threads);
+    bool complete = (size_t)num_rows < cursor.batch_rows;
+    if (entry == NULL) {
+      if (complete) fprintf(stream, "\n");
+      if (profile) {
+        profile->phase_ns[PHASE_WRITING] += SDM_now_ns() - phase_start;
+        profile->bytes_written += bytes_written;
+      }
+      SDM_arena_reset(&worker->arena);
+      if (complete) break;
+      continue;
+    }
+
+    // The batch has to be on disk before the manifest says so
+    if (SDM_sync_file(stream) != 0) {
+      fprintf(stderr, "ERROR: Could not write %s: %s\n", filename, strerror(errno));
+      defered_return(1);
+    }
+    if (profile) {
+      profile->phase_ns[PHASE_WRITING] += SDM_now_ns() - phase_start;
+      profile->bytes_written += bytes_written;
+    }
+
+    SDM_mutex_lock(queue->checkpoint_lock);
+    checkpoint_update(entry, ftell(stream), rows_kept, &cursor, complete);
+    int saved = checkpoint_save(queue->checkpoint);
+    SDM_mutex_unlock(queue->checkpoint_lock);
+    if (saved != 0) defered_return(1);
+
+    SDM_arena_reset(&worker->arena);
+    if (complete) break;
+  }
+
+defer:
+  if (use_lod && lod_close(&lod) != 0) {
+    fprintf(stderr, "ERROR: Could not write the whole pyramid for %s\n", attr->name);
+    result = 1;
+  }
+  if (input_args->save_to_file && stream) fclose(stream);
+  if (!input_args->save_to_file) stdout_finish(queue->stdout_order, attr_num);
+  if (filename) FREE(filename);
+  FREE(cursor.last_value);
+  // Hand the memory for this dataset back to the arena for the next attribute
+  SDM_arena_reset(&worker->arena);
+  if (attr_profile) {
+    profile->arena_regions += worker->arena.num_regions - regions_before;
+    attr_profile->fetched = true;
+    attr_profile->result = result;
+  }
+  return result;
+}
+
+void *fetch_worker(void *arg) {
+  FetchWorker *worker = arg;
+  FetchQueue *queue = worker->queue;
+  bool connected = true;
+
+  if (worker->conn == NULL) {
+    uint64_t phase_start = SDM_now_ns();
+    worker->conn = connect_to_endpoint(queue->endpoint, queue->password);
+    if (PQstatus(worker->conn) != CONNECTION_OK && queue->input_args->resume) {
+      reconnect_with_backoff(worker->conn, queue->endpoint->name);
+    }
+    worker->profile.phase_ns[PHASE_CONNECT] += SDM_now_ns() - phase_start;
+    if (PQstatus(worker->conn) != CONNECTION_OK) {
+      fprintf(stderr, "ERROR: %s: %s", queue->endpoint->name, PQerrorMessage(worker->conn));
+      worker->result = 1;
+      connected = false;
+    }
+  }
+
+  while (connected) {
+    SDM_mutex_lock(&queue->jobs_lock);
+    size_t job = queue->next_job++;
+    SDM_mutex_unlock(&queue->jobs_lock);
+    if (job >= queue->jobs.length) break;
+
+    if (process_attribute(worker, queue->jobs.data[job].attr_num) != 0) worker->result = 1;
+  }
+
+  // If every worker of this database failed to connect, nothing will print its attributes, so
+  // they are dropped from the stdout order for the other databases to carry on
+  SDM_mutex_lock(&queue->jobs_lock);
+  size_t first_dropped = queue->jobs.length;
+  if (--queue->workers_left == 0 && queue->next_job < queue->jobs.length) first_dropped = queue->next_job;
+  SDM_mutex_unlock(&queue->jobs_lock);
+  if (!queue->input_args->save_to_file) {
+    for (size_t job=first_dropped; job<queue->jobs.length; job++) {
+      stdout_finish(queue->stdout_order, queue->jobs.data[job].attr_num);
+    }
+  }
+
+  return NULL;
+}
+
+static void json_write_string(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+    else if (c < 0x20)         fprintf(f, "\\u%04x", c);
+    else                       fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+static void json_write_profile(FILE *f, const Profile *p) {
+  fprintf(f, "\"phases_s\": {");
+  for (size_t i=0; i<PHASE_COUNT; i++) {
+    fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", profile_phase_names[i], (double)p->phase_ns[i] / 1e9);
+  }
+  fprintf(f, "}, \"rows_received\": %zu, \"rows_kept\": %zu, \"bytes_received\": %zu, "
+             "\"bytes_written\": %zu, \"arena_regions\": %zu",
+          p->rows_received, p->rows_kept, p->bytes_received, p->bytes_written, p->arena_regions);
+}
+
+int write_profile_report(const char *file_path, uint64_t wall_ns, const FetchQueue *queues, size_t num_queues,
+                         const FetchWorker *workers, size_t num_workers, const ArchiverAttrs *attrs,
+                         const AttrProfile *attr_profiles) {
+  // The phase times are summed over all threads, so with --jobs the totals can exceed wall_time_s
+  FILE *f = fopen(file_path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", file_path, strerror(errno));
+    return -1;
+  }
+
+  Profile total = {0};
+  fprintf(f, "{\n  \"databases\": [");
+  for (size_t i=0; i<num_queues; i++) {
+    Profile db = queues[i].profile;
+    for (size_t w=0; w<num_workers; w++) {
+      if (workers[w].queue == &queues[i]) profile_add(&db, &workers[w].profile);
+    }
+    profile_add(&total, &db);
+    fprintf(f, "%s\n    {\"name\": ", i ? "," : "");
+    json_write_string(f, queues[i].endpoint->name);
+    fprintf(f, ", \"attributes\": %zu, ", queues[i].local_attrs.length);
+    json_write_profile(f, &db);
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n  ],\n  \"attributes\": [");
+  for (size_t i=0; i<attrs->length; i++) {
+    const AttrProfile *ap = &attr_profiles[i];
+    profile_add(&total, &ap->profile);
+    fprintf(f, "%s\n    {\"file_number\": %zu, \"name\": ", i ? "," : "", i+1);
+    json_write_string(f, attrs->data[i].name);
+    fprintf(f, ", \"database\": ");
+    json_write_string(f, queues[ap->queue_num].endpoint->name);
+    fprintf(f, ", \"status\": \"%s\", ", !ap->fetched ? "skipped" : ap->result == 0 ? "ok" : "failed");
+    json_write_profile(f, &ap->profile);
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n  ],\n  \"total\": {\"wall_time_s\": %.6f, \"peak_rss_bytes\": %zu, ",
+          (double)wall_ns / 1e9, SDM_peak_rss_bytes());
+  json_write_profile(f, &total);
+  fprintf(f, "}\n}\n");
+
+  if (fclose(f) != 0) {
+    fprintf(stderr, "ERROR: Could not write %s: %s\n", file_path, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
 int main(int argc, char **argv) {
   int result = 0;
   ArchiverAttrs attrs = {0};
-  PGconn *conn = NULL;
-  char *conn_str = NULL;
-  PGresult *res = NULL;
+  DbEndpoints endpoints = {0};
+  FetchQueue *queues = NULL;
+  StdoutOrder stdout_order = {.lock=SDM_MUTEX_INIT, .turn=SDM_COND_INIT};
+  FetchWorker *workers = NULL;
+  size_t num_workers = 0;
+  AttrProfile *attr_profiles = NULL;
+  Checkpoint checkpoint = {0};
+  SDM_Mutex checkpoint_lock = SDM_MUTEX_INIT;
+  char *manifest_path = NULL;
+  uint64_t start_ns = SDM_now_ns();
 
   char *program_name = SDM_shift_args(&argc, &argv);
-  FILE *stream = NULL;
-  char *filename = NULL;
 
-  InputArgs input_args = {0};
+  InputArgs input_args = {.num_workers=1, .batch_rows=DEFAULT_BATCH_ROWS};
 
   while (argc > 0) {
     char *arg_str = SDM_shift_args(&argc, &argv);
@@ -131,7 +665,55 @@ int main(int argc, char **argv) {
       input_args.verbose = true;
     } else if ((strcmp(arg_str, "--decimate") == 0)) {
       input_args.decimate = true;
-      input_args.decimate_factor = atoi(SDM_shift_args(&argc, &argv));
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.decimate_factor) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--elements") == 0)) {
+      input_args.elements_arg = SDM_shift_args(&argc, &argv);
+      if (parse_element_ranges(input_args.elements_arg, &input_args.query_opts.elements) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--config") == 0) || (strcmp(arg_str, "-c") == 0)) {
+      input_args.config_file = SDM_shift_args(&argc, &argv);
+    } else if ((strcmp(arg_str, "--jobs") == 0) || (strcmp(arg_str, "-j") == 0)) {
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.num_workers) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--memory-limit") == 0)) {
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.memory_limit_mb) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--threads") == 0)) {
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.num_format_threads) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--changes-only") == 0)) {
+      input_args.query_opts.changes_only = true;
+    } else if ((strcmp(arg_str, "--deadband") == 0)) {
+      if (parse_deadband(SDM_shift_args(&argc, &argv), &input_args.query_opts) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--resume") == 0)) {
+      input_args.resume = true;
+    } else if ((strcmp(arg_str, "--batch") == 0)) {
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.batch_rows) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
+    } else if ((strcmp(arg_str, "--profile") == 0)) {
+      input_args.profile_file = SDM_shift_args(&argc, &argv);
+    } else if ((strcmp(arg_str, "--pyramid") == 0)) {
+      input_args.pyramid = true;
+      if (parse_int_arg(arg_str, SDM_shift_args(&argc, &argv), &input_args.pyramid_factor) != 0) {
+        usage(stderr, program_name);
+        defered_return(1);
+      }
     } else {
       SDM_ARRAY_PUSH(input_args.search_strs, arg_str);
     }
@@ -187,131 +769,212 @@ int main(int argc, char **argv) {
   }
 
   const char *pass_env_str = "ARCHIVER_PASS";
-  const char *db_type = "postgresql://hdb_viewer";
   const char *db_pass = getenv(pass_env_str);
-  if (!db_pass || strlen(db_pass)==0) {
-      printf("ERROR: No password found in the %s environment variable. Please set this variable.\n", pass_env_str);
-      defered_return(1);
+  if (input_args.config_file != NULL) {
+    if (read_db_config(input_args.config_file, &endpoints) != 0) defered_return(1);
+  } else {
+    if (!db_pass || strlen(db_pass)==0) {
+        printf("ERROR: No password found in the %s environment variable. Please set this variable.\n", pass_env_str);
+        defered_return(1);
+    }
+    DbEndpoint endpoint = {
+      .name=strdup("hdb_machine"),
+      .conninfo=strdup("postgresql://hdb_viewer@timescaledb.maxiv.lu.se:15432/hdb_machine"),
+    };
+    SDM_ARRAY_PUSH(endpoints, endpoint);
   }
-  const char *db_url  = "timescaledb.maxiv.lu.se";
-  const char *db_port = "15432";
-  const char *db_name = "hdb_machine";
-
-  size_t conn_str_size = 0;
-  conn_str_size += strlen(db_type);
-  conn_str_size += strlen(db_pass);
-  conn_str_size += strlen(db_url);
-  conn_str_size += strlen(db_port);
-  conn_str_size += strlen(db_name);
-  conn_str_size += 5;
-
-  conn_str = malloc(conn_str_size * sizeof(char));
-  memset(conn_str, 0, conn_str_size);
-
-  snprintf(conn_str, conn_str_size, "%s:%s@%s:%s/%s", 
-           db_type, db_pass, db_url, db_port, db_name);
+  if (db_pass && strlen(db_pass)==0) db_pass = NULL;
 
   if (input_args.verbose) {
-      printf("INFO: Connection string: %s\n", conn_str);
+    for (size_t i=0; i<endpoints.length; i++) {
+      printf("INFO: Database %s: %s\n", endpoints.data[i].name, endpoints.data[i].conninfo);
+    }
   }
 
-  conn = PQconnectdb(conn_str);
-  if (PQstatus(conn) != CONNECTION_OK) {
-    fprintf(stderr, "%s", PQerrorMessage(conn));
+  // Resolve the attributes on all of the databases at once
+  queues = calloc(endpoints.length, sizeof(FetchQueue));
+  if (queues == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
     defered_return(1);
   }
-
-  int num_matching_attrs = 0;
-  for (size_t i=0; i<input_args.search_strs.length; i++) {
-    num_matching_attrs += get_ids_and_tables(conn, input_args.search_strs.data[i], &attrs);
+  for (size_t i=0; i<endpoints.length; i++) {
+    queues[i] = (FetchQueue){
+      .input_args=&input_args,
+      .start_tm=start_tm,
+      .stop_tm=stop_tm,
+      .endpoint=&endpoints.data[i],
+      .password=db_pass,
+      .attrs=&attrs,
+      .jobs_lock=SDM_MUTEX_INIT,
+      .stdout_order=&stdout_order,
+      .checkpoint=&checkpoint,
+      .checkpoint_lock=&checkpoint_lock,
+    };
+  }
+  if (SDM_run_threads(resolve_endpoint, queues, sizeof(FetchQueue), endpoints.length) != 0) defered_return(1);
+
+  // Merge the matches into one list, database by database, which fixes the output numbering
+  for (size_t i=0; i<endpoints.length; i++) {
+    if (queues[i].result != 0) defered_return(1);
+    for (size_t j=0; j<queues[i].jobs.length; j++) queues[i].jobs.data[j].attr_num += attrs.length;
+    for (size_t j=0; j<queues[i].local_attrs.length; j++) {
+      SDM_ARRAY_PUSH(attrs, queues[i].local_attrs.data[j]);
+    }
   }
-  if (num_matching_attrs <= 0) {
+  if (attrs.length == 0) {
     fprintf(stderr, "ERROR: Search string(s) not found in DB\n");
     defered_return(1);
   }
 
   if (input_args.verbose) {
-      printf("INFO: Found %d attribute(s) matching \n", num_matching_attrs);
+      printf("INFO: Found %zu attribute(s) matching \n", attrs.length);
   }
 
-  PQclear(res);
-
-  for (size_t attr_num=0; attr_num<(size_t)num_matching_attrs; attr_num++) {
-    if (input_args.verbose) {
-        printf("INFO: Querying the database for %s\n", attrs.data[attr_num].name);
+  if (input_args.save_to_file) {
+    // Everything that decides what ends up in the files, so that a resume can't mix two exports
+    const QueryOptions *opts = &input_args.query_opts;
+    char query[1024];
+    snprintf(query, sizeof(query), "start=%s end=%s decimate=%d changes_only=%d deadband=%.17g%s elements=%s",
+             input_args.start_str, input_args.stop_str, input_args.decimate ? input_args.decimate_factor : 1,
+             opts->changes_only, opts->deadband * (opts->deadband_relative ? 100.0 : 1.0),
+             opts->deadband_relative ? "%" : "", input_args.elements_arg ? input_args.elements_arg : "all");
+
+    manifest_path = malloc(strlen(input_args.filename_arg) + 16);
+    if (manifest_path == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory.\n");
+      defered_return(1);
     }
-    
-    DataSet ds = {0};
-    DataSet full_ds = {0};
-    get_single_attr_data(conn, attrs.data[attr_num], &full_ds, start_tm, stop_tm);
-
-    if (!input_args.decimate) ds = full_ds;
-    else {
-        int dec_numpts = 2 * full_ds.time_array.length / input_args.decimate_factor;
-        if (full_ds.time_array.length % input_args.decimate_factor > 0) dec_numpts += 1;
-        SDM_ENSURE_ARRAY_MIN_CAP(ds.time_array, (size_t)dec_numpts);
-        if (full_ds.type == DATATYPE_SCALAR)
-            SDM_ENSURE_ARRAY_MIN_CAP(ds.as.scalar_array, (size_t)dec_numpts);
-        else if (full_ds.type == DATATYPE_VECTOR)
-            SDM_ENSURE_ARRAY_MIN_CAP(ds.as.vector_array, (size_t)dec_numpts);
-        else {
-            fprintf(stderr, "ERROR: Corrupted memory?");
-            defered_return(1);
-        }
-        for (size_t index=0; index<full_ds.time_array.length; index += input_args.decimate_factor) {
-            SDM_ARRAY_PUSH(ds.time_array, full_ds.time_array.data[index]);
-            if (full_ds.type == DATATYPE_SCALAR)
-                SDM_ARRAY_PUSH(ds.as.scalar_array, (full_ds.as.scalar_array.data[index]));
-            else if (full_ds.type == DATATYPE_VECTOR)
-                SDM_ARRAY_PUSH(ds.as.vector_array, full_ds.as.vector_array.data[index]);
-            else {
-                fprintf(stderr, "ERROR: Corrupted memory?");
-                defered_return(1);
-            }
-        }
-        if (full_ds.type == DATATYPE_SCALAR)      SDM_ARRAY_FREE(full_ds.as.scalar_array);
-        else if (full_ds.type == DATATYPE_VECTOR) SDM_ARRAY_FREE(full_ds.as.vector_array);
-        SDM_ARRAY_FREE(full_ds.time_array);
-    }
-    
-    if (input_args.save_to_file) {
-      filename = malloc((strlen(input_args.filename_arg) + 32) * sizeof(char));
-      if (filename == NULL) {
-        fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    sprintf(manifest_path, "%s.manifest", input_args.filename_arg);
+
+    if (input_args.resume) {
+      if (checkpoint_load(&checkpoint, manifest_path) != 0) defered_return(1);
+      if (strcmp(checkpoint.query, query) != 0) {
+        fprintf(stderr, "ERROR: %s is for a different export:\n\t%s\n", manifest_path, checkpoint.query);
         defered_return(1);
       }
-      sprintf(filename, "%s%04zu.dat", input_args.filename_arg, attr_num+1);
-      stream = fopen(filename, "w");
-      if (stream == NULL) {
-        fprintf(stderr, "ERROR: Could not open %s: %s\n", filename, strerror(errno));
+      // The file numbers come from the order of the search results, which has to be unchanged
+      bool same_attrs = checkpoint.length == attrs.length;
+      for (size_t i=0; same_attrs && i<attrs.length; i++) {
+        same_attrs = strcmp(checkpoint.data[i].name, attrs.data[i].name) == 0;
+      }
+      if (!same_attrs) {
+        fprintf(stderr, "ERROR: The search no longer finds the attributes listed in %s\n", manifest_path);
         defered_return(1);
       }
     } else {
-      stream = stdout;
+      checkpoint.file_path = strdup(manifest_path);
+      checkpoint.query = strdup(query);
+      for (size_t i=0; i<attrs.length; i++) {
+        CheckpointEntry entry = {.name=strdup(attrs.data[i].name)};
+        SDM_ARRAY_PUSH(checkpoint, entry);
+      }
+      if (checkpoint_save(&checkpoint) != 0) defered_return(1);
     }
+  }
 
-    fprintf(stream, "\"# DATASET= %s\"\n", attrs.data[attr_num].name);
-    fprintf(stream, "\"# SNAPSHOT_TIME= \"\n");
+  if (!input_args.save_to_file) {
+    stdout_order.finished = calloc(attrs.length, sizeof(bool));
+    stdout_order.num_attrs = attrs.length;
+    if (stdout_order.finished == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory.\n");
+      defered_return(1);
+    }
+  }
 
-    write_dataset_to_stream(stream, ds);
+  if (input_args.profile_file != NULL) {
+    attr_profiles = calloc(attrs.length, sizeof(AttrProfile));
+    if (attr_profiles == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate memory.\n");
+      defered_return(1);
+    }
+    size_t attr_num = 0;
+    for (size_t i=0; i<endpoints.length; i++) {
+      queues[i].attr_profiles = attr_profiles;
+      for (size_t j=0; j<queues[i].local_attrs.length; j++) attr_profiles[attr_num++].queue_num = i;
+    }
+  }
 
-    if (input_args.save_to_file) {
-      fclose(stream);
-      FREE(filename);
+  // Each database gets up to --jobs workers of its own
+  for (size_t i=0; i<endpoints.length; i++) {
+    size_t n = (size_t)input_args.num_workers;
+    num_workers += n < queues[i].jobs.length ? n : queues[i].jobs.length;
+  }
+  workers = calloc(num_workers, sizeof(FetchWorker));
+  if (workers == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory.\n");
+    defered_return(1);
+  }
+  size_t peak_bytes = 0;
+  size_t worker_num = 0;
+  for (size_t i=0; i<endpoints.length; i++) {
+    peak_bytes += peak_estimate_bytes(&queues[i], (size_t)input_args.num_workers);
+    size_t n = (size_t)input_args.num_workers;
+    queues[i].workers_left = n < queues[i].jobs.length ? n : queues[i].jobs.length;
+    for (size_t j=0; j<(size_t)input_args.num_workers && j<queues[i].jobs.length; j++) {
+      workers[worker_num].queue = &queues[i];
+      // The first worker reuses the connection we already have, the others open their own
+      if (j == 0) {
+        workers[worker_num].conn = queues[i].conn;
+        queues[i].conn = NULL;
+      }
+      worker_num++;
     }
+  }
+  if (input_args.verbose) {
+    printf("INFO: Estimated peak memory use of %zu MB with %zu worker(s)\n",
+           peak_bytes / (1024*1024), num_workers);
+  }
+  size_t memory_limit = input_args.memory_limit_mb > 0 ?
+    (size_t)input_args.memory_limit_mb * 1024*1024 : SDM_physical_memory_bytes();
+  if (memory_limit > 0 && peak_bytes > memory_limit) {
+    fprintf(stderr, "WARNING: The estimated peak memory use of %zu MB is over the limit of %zu MB. ",
+            peak_bytes / (1024*1024), memory_limit / (1024*1024));
+    fprintf(stderr, "Consider fewer --jobs or a smaller --batch.\n");
+  }
 
-    // Free memory for this dataset immediately after output
-    if (ds.type == DATATYPE_SCALAR)      SDM_ARRAY_FREE(ds.as.scalar_array);
-    else if (ds.type == DATATYPE_VECTOR) SDM_ARRAY_FREE(ds.as.vector_array);
-    SDM_ARRAY_FREE(ds.time_array);
+  // Unless --threads says otherwise, the workers share the CPUs out for formatting
+  if (input_args.num_format_threads == 0) {
+    size_t per_worker = SDM_cpu_count() / (num_workers > 0 ? num_workers : 1);
+    input_args.num_format_threads = per_worker > 0 ? (int)per_worker : 1;
+  }
+
+  if (SDM_run_threads(fetch_worker, workers, sizeof(FetchWorker), num_workers) != 0) result = 1;
+
+  for (size_t i=0; i<num_workers; i++) {
+    if (workers[i].result != 0) result = 1;
+  }
+
+  if (attr_profiles != NULL) {
+    if (write_profile_report(input_args.profile_file, SDM_now_ns() - start_ns, queues, endpoints.length,
+                             workers, num_workers, &attrs, attr_profiles) != 0) {
+      result = 1;
+    } else if (input_args.verbose) {
+      printf("INFO: Wrote the profile to %s\n", input_args.profile_file);
+    }
   }
 
 defer:
-  if (conn_str) FREE(conn_str);
-  if (conn)     PQfinish(conn);
-  // TODO: Memory leak here
-  // if (attrs)    FREE(attrs);
-  if (filename) FREE(filename);
+  if (workers) {
+    for (size_t i=0; i<num_workers; i++) {
+      if (workers[i].conn) PQfinish(workers[i].conn);
+      SDM_arena_free(&workers[i].arena);
+    }
+    FREE(workers);
+  }
+  if (queues) {
+    for (size_t i=0; i<endpoints.length; i++) {
+      if (queues[i].conn) PQfinish(queues[i].conn);
+      SDM_ARRAY_FREE(queues[i].local_attrs);
+      SDM_ARRAY_FREE(queues[i].jobs);
+    }
+    FREE(queues);
+  }
+  if (attr_profiles) FREE(attr_profiles);
+  if (stdout_order.finished) FREE(stdout_order.finished);
+  checkpoint_free(&checkpoint);
+  if (manifest_path) FREE(manifest_path);
+  free_db_endpoints(&endpoints);
+  SDM_ARRAY_FREE(attrs);
   return result;
 }
 
@@ -5,6 +5,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define PSAPI_VERSION 2
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #include "sdm_lib.h"
 
 char *SDM_read_entire_file(const char *file_path) {
@@ -86,3 +97,286 @@ char *SDM_shift_args(int *argc, char ***argv) {
   return *ret;
 }
 
+static SDM_ArenaRegion *SDM_new_region(SDM_Arena *arena, size_t capacity) {
+  if (capacity > (SIZE_MAX - sizeof(SDM_ArenaRegion)) / sizeof(uintptr_t)) {
+    fprintf(stderr, "ERR: Arena region of %zu words is too big.\n", capacity);
+    exit(1);
+  }
+  arena->num_regions++;
+  size_t size_bytes = sizeof(SDM_ArenaRegion) + capacity * sizeof(uintptr_t);
+  SDM_ArenaRegion *region = malloc(size_bytes);
+  if (region == NULL) {
+    fprintf(stderr, "ERR: Couldn't alloc memory.\n");
+    exit(1);
+  }
+  region->next = NULL;
+  region->count = 0;
+  region->capacity = capacity;
+  return region;
+}
+
+static SDM_ArenaRegion *SDM_arena_region_with_room(SDM_Arena *arena, size_t words) {
+  // Returns the first region from arena->end onwards with room for `words`, appending a new
+  // region to the list if none of the existing ones will do
+  if (arena->end == NULL) {
+    size_t capacity = SDM_ARENA_DEFAULT_CAPACITY / sizeof(uintptr_t);
+    if (capacity < words) capacity = words;
+    arena->begin = SDM_new_region(arena, capacity);
+    arena->end = arena->begin;
+  }
+
+  while (arena->end->count + words > arena->end->capacity && arena->end->next != NULL) {
+    arena->end = arena->end->next;
+  }
+
+  if (arena->end->count + words > arena->end->capacity) {
+    size_t capacity = SDM_ARENA_DEFAULT_CAPACITY / sizeof(uintptr_t);
+    if (capacity < words) capacity = words;
+    arena->end->next = SDM_new_region(arena, capacity);
+    arena->end = arena->end->next;
+  }
+
+  return arena->end;
+}
+
+void *SDM_arena_alloc(SDM_Arena *arena, size_t size_bytes) {
+  if (size_bytes > SIZE_MAX - sizeof(uintptr_t)) {
+    fprintf(stderr, "ERR: Arena allocation of %zu bytes is too big.\n", size_bytes);
+    exit(1);
+  }
+  size_t words = (size_bytes + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+  SDM_ArenaRegion *region = SDM_arena_region_with_room(arena, words);
+  void *result = &region->data[region->count];
+  region->count += words;
+  return result;
+}
+
+void *SDM_arena_alloc_array(SDM_Arena *arena, size_t count, size_t item_size) {
+  if (item_size != 0 && count > SIZE_MAX / item_size) {
+    fprintf(stderr, "ERR: Arena array of %zu items is too big.\n", count);
+    exit(1);
+  }
+  return SDM_arena_alloc(arena, count * item_size);
+}
+
+void SDM_arena_reserve(SDM_Arena *arena, size_t size_bytes) {
+  // Makes sure that the next size_bytes worth of allocations can be served from a single region
+  size_t words = (size_bytes + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+  SDM_arena_region_with_room(arena, words);
+}
+
+void SDM_arena_reset(SDM_Arena *arena) {
+  // If the previous use of the arena spilled into several regions, replace them with a single
+  // region big enough for all of it, so that the arena settles into one block after the first
+  // few uses
+  if (arena->begin != NULL && arena->begin->next != NULL) {
+    size_t capacity = 0;
+    for (SDM_ArenaRegion *r = arena->begin; r != NULL; r = r->next) capacity += r->capacity;
+    SDM_arena_free(arena);
+    arena->begin = SDM_new_region(arena, capacity);
+  }
+  if (arena->begin != NULL) arena->begin->count = 0;
+  arena->end = arena->begin;
+}
+
+void SDM_arena_free(SDM_Arena *arena) {
+  SDM_ArenaRegion *r = arena->begin;
+  while (r != NULL) {
+    SDM_ArenaRegion *next = r->next;
+    free(r);
+    r = next;
+  }
+  arena->begin = NULL;
+  arena->end = NULL;
+}
+
+#ifdef _WIN32
+typedef struct {
+  SDM_ThreadFn fn;
+  void *arg;
+} SDM_ThreadStart;
+
+static DWORD WINAPI SDM_thread_trampoline(LPVOID param) {
+  SDM_ThreadStart start = *(SDM_ThreadStart*)param;
+  free(param);
+  start.fn(start.arg);
+  return 0;
+}
+
+int SDM_thread_create(SDM_Thread *thread, SDM_ThreadFn fn, void *arg) {
+  SDM_ThreadStart *start = malloc(sizeof(SDM_ThreadStart));
+  if (start == NULL) return -1;
+  start->fn = fn;
+  start->arg = arg;
+  thread->handle = CreateThread(NULL, 0, SDM_thread_trampoline, start, 0, NULL);
+  if (thread->handle == NULL) {
+    free(start);
+    return -1;
+  }
+  return 0;
+}
+
+void SDM_thread_join(SDM_Thread thread) {
+  WaitForSingleObject(thread.handle, INFINITE);
+  CloseHandle(thread.handle);
+}
+
+void SDM_mutex_lock(SDM_Mutex *mutex) {
+  AcquireSRWLockExclusive((PSRWLOCK)&mutex->lock);
+}
+
+void SDM_mutex_unlock(SDM_Mutex *mutex) {
+  ReleaseSRWLockExclusive((PSRWLOCK)&mutex->lock);
+}
+
+void SDM_cond_wait(SDM_Cond *cond, SDM_Mutex *mutex) {
+  SleepConditionVariableSRW((PCONDITION_VARIABLE)&cond->cond, (PSRWLOCK)&mutex->lock, INFINITE, 0);
+}
+
+void SDM_cond_broadcast(SDM_Cond *cond) {
+  WakeAllConditionVariable((PCONDITION_VARIABLE)&cond->cond);
+}
+
+size_t SDM_cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+}
+
+uint64_t SDM_now_ns(void) {
+  // Monotonic, only meaningful as a difference between two calls
+  static LARGE_INTEGER frequency = {0};
+  if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER count;
+  QueryPerformanceCounter(&count);
+  return (uint64_t)(count.QuadPart / frequency.QuadPart) * 1000000000ull
+       + (uint64_t)(count.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+}
+
+size_t SDM_peak_rss_bytes(void) {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+  return counters.PeakWorkingSetSize;
+}
+
+size_t SDM_physical_memory_bytes(void) {
+  MEMORYSTATUSEX status = {.dwLength = sizeof(status)};
+  if (!GlobalMemoryStatusEx(&status)) return 0;
+  return (size_t)status.ullTotalPhys;
+}
+
+void SDM_sleep_ms(unsigned ms) {
+  Sleep(ms);
+}
+
+int SDM_sync_file(FILE *f) {
+  if (fflush(f) != 0) return -1;
+  return _commit(_fileno(f));
+}
+
+int SDM_truncate_file(FILE *f, long length) {
+  if (fflush(f) != 0) return -1;
+  return _chsize_s(_fileno(f), length) == 0 ? 0 : -1;
+}
+
+int SDM_replace_file(const char *from, const char *to) {
+  return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+}
+#else
+int SDM_thread_create(SDM_Thread *thread, SDM_ThreadFn fn, void *arg) {
+  return pthread_create(&thread->handle, NULL, fn, arg) == 0 ? 0 : -1;
+}
+
+void SDM_thread_join(SDM_Thread thread) {
+  pthread_join(thread.handle, NULL);
+}
+
+void SDM_mutex_lock(SDM_Mutex *mutex) {
+  pthread_mutex_lock(&mutex->lock);
+}
+
+void SDM_mutex_unlock(SDM_Mutex *mutex) {
+  pthread_mutex_unlock(&mutex->lock);
+}
+
+void SDM_cond_wait(SDM_Cond *cond, SDM_Mutex *mutex) {
+  pthread_cond_wait(&cond->cond, &mutex->lock);
+}
+
+void SDM_cond_broadcast(SDM_Cond *cond) {
+  pthread_cond_broadcast(&cond->cond);
+}
+
+size_t SDM_cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (size_t)count : 1;
+}
+
+uint64_t SDM_now_ns(void) {
+  // Monotonic, only meaningful as a difference between two calls
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+size_t SDM_peak_rss_bytes(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return (size_t)usage.ru_maxrss;
+#else
+  return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+size_t SDM_physical_memory_bytes(void) {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  return pages > 0 && page_size > 0 ? (size_t)pages * (size_t)page_size : 0;
+}
+
+void SDM_sleep_ms(unsigned ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+}
+
+int SDM_sync_file(FILE *f) {
+  if (fflush(f) != 0) return -1;
+  return fsync(fileno(f));
+}
+
+int SDM_truncate_file(FILE *f, long length) {
+  if (fflush(f) != 0) return -1;
+  return ftruncate(fileno(f), (off_t)length);
+}
+
+int SDM_replace_file(const char *from, const char *to) {
+  // rename() is atomic on POSIX, so readers see either the old file or the new one
+  return rename(from, to);
+}
+#endif
+
+size_t SDM_start_threads(SDM_Thread *threads, SDM_ThreadFn fn, void *args, size_t arg_size, size_t count) {
+  // Starts a thread for each of the count items in args, stopping at the first that can't be
+  // started, and returns how many were
+  size_t num_started = 0;
+  for (; num_started<count; num_started++) {
+    if (SDM_thread_create(&threads[num_started], fn, (char*)args + num_started*arg_size) != 0) {
+      fprintf(stderr, "WARNING: Could only start %zu of %zu threads\n", num_started, count);
+      break;
+    }
+  }
+  return num_started;
+}
+
+int SDM_run_threads(SDM_ThreadFn fn, void *args, size_t arg_size, size_t count) {
+  // Runs fn on each of the count items in args, each on its own thread unless there is only one.
+  // Items that don't get a thread are run on the calling thread instead, so every item always
+  // runs and this only returns 0.
+  SDM_Thread *threads = count > 1 ? calloc(count, sizeof(SDM_Thread)) : NULL;
+  size_t num_started = threads != NULL ? SDM_start_threads(threads, fn, args, arg_size, count) : 0;
+  for (size_t i=num_started; i<count; i++) fn((char*)args + i*arg_size);
+  for (size_t i=0; i<num_started; i++) SDM_thread_join(threads[i]);
+  if (threads) FREE(threads);
+  return 0;
+}
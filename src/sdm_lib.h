@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #define FREE(ptr) do { free(ptr); ptr = NULL; } while (0)
@@ -40,7 +41,6 @@
     if (((da).capacity == 0) || ((da).data == NULL)) {            \
       (da).capacity = DEFAULT_CAPACITY;                           \
       (da).data = malloc((da).capacity * sizeof((da).data[0]));   \
-      memset((da).data, 0, (da).capacity * sizeof((da).data[0])); \
       if ((da).data == NULL) {                                    \
         fprintf(stderr, "ERR: Couldn't alloc memory.\n");         \
         exit(1);                                                  \
@@ -66,6 +66,91 @@
 
 #define SDM_ARRAY_RESET(da) do { (da).length = 0; } while (0)
 
+// A simple region allocator.  Memory is handed out linearly from a list of
+// regions, and is only ever given back all at once with SDM_arena_reset (which
+// keeps the memory around for reuse) or SDM_arena_free.  Arrays whose data is
+// taken from an arena must never be passed to realloc/free, so size them with
+// SDM_ARENA_ARRAY_INIT and push onto them with SDM_ARENA_PUSH.
+typedef struct SDM_ArenaRegion SDM_ArenaRegion;
+struct SDM_ArenaRegion {
+  SDM_ArenaRegion *next;
+  size_t count;
+  size_t capacity;
+  uintptr_t data[];
+};
+
+typedef struct {
+  SDM_ArenaRegion *begin;
+  SDM_ArenaRegion *end;
+  size_t num_regions; // Regions created over the arena's lifetime, for profiling
+} SDM_Arena;
+
+#define SDM_ARENA_DEFAULT_CAPACITY (8*1024*1024)
+
+void *SDM_arena_alloc(SDM_Arena *arena, size_t size_bytes);
+void *SDM_arena_alloc_array(SDM_Arena *arena, size_t count, size_t item_size);
+void SDM_arena_reserve(SDM_Arena *arena, size_t size_bytes);
+void SDM_arena_reset(SDM_Arena *arena);
+void SDM_arena_free(SDM_Arena *arena);
+
+#define SDM_ARENA_ARRAY_INIT(arena, da, cap) do {                 \
+    (da).length = 0;                                              \
+    (da).capacity = (cap);                                        \
+    (da).data = SDM_arena_alloc_array((arena), (da).capacity,     \
+        sizeof((da).data[0]));                                    \
+  } while (0)
+
+// Push onto an array set up with SDM_ARENA_ARRAY_INIT.  These never grow, since
+// realloc on arena memory would corrupt the heap, so running out of room is a
+// bug that stops the program (in release builds too).
+#define SDM_ARENA_PUSH(da, item) do {                             \
+    if ((da).length >= (da).capacity) {                           \
+      fprintf(stderr, "ERR: Arena array full at %s:%d\n",         \
+              __FILE__, __LINE__);                                \
+      abort();                                                    \
+    }                                                             \
+    (da).data[(da).length++] = item;                              \
+  } while (0)
+
+// Minimal portable threads: pthreads everywhere except Windows, which uses its native API
+#ifdef _WIN32
+typedef struct { void *handle; } SDM_Thread;
+typedef struct { void *lock; } SDM_Mutex;
+#define SDM_MUTEX_INIT {0}
+typedef struct { void *cond; } SDM_Cond;
+#define SDM_COND_INIT {0}
+#else
+#include <pthread.h>
+typedef struct { pthread_t handle; } SDM_Thread;
+typedef struct { pthread_mutex_t lock; } SDM_Mutex;
+#define SDM_MUTEX_INIT {PTHREAD_MUTEX_INITIALIZER}
+typedef struct { pthread_cond_t cond; } SDM_Cond;
+#define SDM_COND_INIT {PTHREAD_COND_INITIALIZER}
+#endif
+
+typedef void *(*SDM_ThreadFn)(void *arg);
+
+int SDM_thread_create(SDM_Thread *thread, SDM_ThreadFn fn, void *arg);
+void SDM_thread_join(SDM_Thread thread);
+void SDM_mutex_lock(SDM_Mutex *mutex);
+void SDM_mutex_unlock(SDM_Mutex *mutex);
+void SDM_cond_wait(SDM_Cond *cond, SDM_Mutex *mutex);
+void SDM_cond_broadcast(SDM_Cond *cond);
+size_t SDM_start_threads(SDM_Thread *threads, SDM_ThreadFn fn, void *args, size_t arg_size, size_t count);
+int SDM_run_threads(SDM_ThreadFn fn, void *args, size_t arg_size, size_t count);
+size_t SDM_cpu_count(void);
+
+uint64_t SDM_now_ns(void);
+size_t SDM_peak_rss_bytes(void);
+size_t SDM_physical_memory_bytes(void);
+void SDM_sleep_ms(unsigned ms);
+
+// Durable file updates: flush a stream all the way to disk, cut a file back to a known length,
+// and replace one file with another in a single step
+int SDM_sync_file(FILE *f);
+int SDM_truncate_file(FILE *f, long length);
+int SDM_replace_file(const char *from, const char *to);
+
 typedef struct {
   size_t length;
   char *data;